@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# Protocol checks against the simulator; run by `make check'.
+
+set -e
+cd "$(dirname "$0")"
+
+tmp=$(mktemp -d)
+sim=
+trap '[ -n "$sim" ] && kill $sim; rm -rf "$tmp"' EXIT
+
+# Starts vuxsim with the given options and sets $port to its terminal.
+start_sim() {
+  ./vuxsim -b 0 "$@" > "$tmp/port" &
+  sim=$!
+  while [ ! -s "$tmp/port" ]; do sleep 0.1; done
+  port=$(cat "$tmp/port")
+}
+
+stop_sim() {
+  kill $sim
+  wait $sim 2> /dev/null || true
+  sim=
+}
+
+head -c 3072 /dev/urandom > "$tmp/image.bin"
+
+# A page damaged on the line is refused, and the page sent again must be
+# written intact rather than mixed with the damaged one.
+start_sim -K 3
+./vuxprog fw "$tmp/image.bin" -f binary -C -s "$port" > /dev/null
+./vuxprog fr "$tmp/dump.bin" -f binary -s "$port" > /dev/null
+stop_sim
+cmp -n 3072 "$tmp/image.bin" "$tmp/dump.bin"
+echo "retransmitted page: ok"
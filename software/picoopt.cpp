@@ -41,7 +41,7 @@ bool parser::parse(vector<string> strings) {
   for(int i = 0; i < strings.size(); i++) {
     string s = strings[i];
 
-    if(s[0] == '-') {
+    if(s[0] == '-' && s.size() > 1) { // a lone dash is an argument
       if(s.size() > 2) {
         cerr << "error: option " << s << " is unsupported" << endl;
         return false;
@@ -85,22 +85,12 @@ bool parser::parse(int argc, const char* const* argv) {
 
 bool parser::parse(istream& in) {
   vector<string> options;
-  char opt[128];
 
   if(!in.good())
     return false;
-  while(!in.eof()) {
-    in.getline(opt, 128);
-    string sopt(string(opt) + " ");
-    int start = -1;
-    for(int i = 1; i < sopt.length(); i++) {
-      if(sopt[i] == ' ') {
-        if(start != i-1)
-          options.push_back(sopt.substr(start+1, i-start-1));
-        start = i;
-      }
-    }
-  }
+  string word;
+  while(in >> word)
+    options.push_back(word);
 
   return parse(options);
 }
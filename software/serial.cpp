@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2010 Peter Zotov <whitequark@whitequark.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#include <linux/serial.h>
+#include "serial.h"
+
+bool serial_set_baud(int fd, unsigned rate) {
+  struct termios2 tio;
+  if(ioctl(fd, TCGETS2, &tio) == -1)
+    return false;
+
+  tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+  tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+  tio.c_ispeed = rate;
+  tio.c_ospeed = rate;
+
+  return ioctl(fd, TCSETS2, &tio) != -1;
+}
+
+bool serial_set_low_latency(int fd, bool enable, bool& was_enabled) {
+  struct serial_struct serial;
+  if(ioctl(fd, TIOCGSERIAL, &serial) == -1)
+    return false;
+
+  was_enabled = (serial.flags & ASYNC_LOW_LATENCY) != 0;
+  if(enable)
+    serial.flags |= ASYNC_LOW_LATENCY;
+  else
+    serial.flags &= ~ASYNC_LOW_LATENCY;
+
+  return ioctl(fd, TIOCSSERIAL, &serial) != -1;
+}
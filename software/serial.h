@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2010 Peter Zotov <whitequark@whitequark.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _SERIAL_H_
+#define _SERIAL_H_
+
+// Linux-specific port settings. They live in a separate file because
+// <asm/termbits.h> cannot be included together with <termios.h>.
+
+// Sets an arbitrary baud rate; returns false if the driver cannot do it.
+bool serial_set_baud(int fd, unsigned rate);
+
+// Toggles ASYNC_LOW_LATENCY, which makes e.g. FTDI adapters pass received
+// bytes on at once; returns false if the driver does not support it.
+bool serial_set_low_latency(int fd, bool enable, bool& was_enabled);
+
+#endif
@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2010 Peter Zotov <whitequark@whitequark.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <errno.h>
+#include "trace.h"
+
+using namespace std;
+
+namespace vux {
+
+static const char MAGIC[] = "VXTR";
+static const unsigned VERSION = 1;
+
+// longest pause of the device that is reproduced by replay, in microseconds
+static const long long MAX_DELAY = 1000000;
+
+static void put_number(string& to, unsigned long long value, unsigned bytes) {
+  for(unsigned i = 0; i < bytes; i++)
+    to += char(value >> (i * 8));
+}
+
+static unsigned long long get_number(const char* from, unsigned bytes) {
+  unsigned long long value = 0;
+  for(unsigned i = 0; i < bytes; i++)
+    value |= (unsigned long long) (unsigned char) from[i] << (i * 8);
+  return value;
+}
+
+trace::trace(unsigned capacity) : _ring(capacity), _head(0), _used(0), _dropped(0) {}
+
+void trace::add(char direction, long long time, const char* data, unsigned length) {
+  unsigned limit = _ring.size() - HEADER_BYTES;
+  if(limit > 0xffff)
+    limit = 0xffff;
+
+  while(length > 0) {
+    unsigned chunk = length < limit ? length : limit;
+
+    while(_used + HEADER_BYTES + chunk > _ring.size()) {
+      char header[HEADER_BYTES];
+      get(0, header, HEADER_BYTES);
+      _used -= HEADER_BYTES + get_number(header + 9, 2);
+      _dropped++;
+    }
+
+    char header[HEADER_BYTES];
+    for(unsigned i = 0; i < 8; i++)
+      header[i] = char((unsigned long long) time >> (i * 8));
+    header[8] = direction;
+    header[9] = char(chunk);
+    header[10] = char(chunk >> 8);
+
+    put(header, HEADER_BYTES);
+    put(data, chunk);
+
+    data += chunk;
+    length -= chunk;
+  }
+}
+
+void trace::put(const char* data, unsigned length) {
+  for(unsigned i = 0; i < length; i++) {
+    _ring[_head] = data[i];
+    _head = (_head + 1) % _ring.size();
+  }
+  _used += length;
+}
+
+// Copies bytes starting `offset' bytes after the oldest one.
+void trace::get(unsigned offset, char* data, unsigned length) {
+  unsigned tail = (_head + _ring.size() - _used + offset) % _ring.size();
+  for(unsigned i = 0; i < length; i++)
+    data[i] = _ring[(tail + i) % _ring.size()];
+}
+
+bool trace::save(string filename) {
+  string header(MAGIC);
+  put_number(header, VERSION, 1);
+  put_number(header, _dropped, 4);
+
+  vector<char> contents(_used);
+  if(_used > 0)
+    get(0, &contents[0], _used);
+
+  ofstream out(filename.c_str(), ios::binary);
+  out.write(header.data(), header.length());
+  if(_used > 0)
+    out.write(&contents[0], _used);
+  return !!out;
+}
+
+bool trace::load(string filename, vector<record>& records, unsigned& dropped) {
+  ifstream in(filename.c_str(), ios::binary);
+  string contents((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+  if(!in && !in.eof())
+    return false;
+
+  unsigned header = strlen(MAGIC) + 5;
+  if(contents.length() < header || contents.substr(0, strlen(MAGIC)) != MAGIC ||
+        (unsigned char) contents[strlen(MAGIC)] != VERSION)
+    return false;
+  dropped = get_number(contents.data() + strlen(MAGIC) + 1, 4);
+
+  records.clear();
+  for(unsigned pos = header; pos < contents.length(); ) {
+    if(pos + HEADER_BYTES > contents.length())
+      return false;
+
+    record r;
+    r.time = get_number(contents.data() + pos, 8);
+    r.direction = contents[pos + 8];
+    unsigned length = get_number(contents.data() + pos + 9, 2);
+    pos += HEADER_BYTES;
+
+    if(pos + length > contents.length())
+      return false;
+    r.data = contents.substr(pos, length);
+    pos += length;
+
+    records.push_back(r);
+  }
+
+  return true;
+}
+
+bool trace_print(string filename, ostream& out) {
+  vector<trace::record> records;
+  unsigned dropped;
+  if(!trace::load(filename, records, dropped)) {
+    cerr << "cannot read trace `" << filename << "'!" << endl;
+    return false;
+  }
+
+  out << "Trace of " << records.size() << " records";
+  if(dropped > 0)
+    out << "; " << dropped << " earlier records were dropped";
+  out << "." << endl;
+
+  unsigned long long sent = 0, received = 0;
+  for(unsigned i = 0; i < records.size(); i++) {
+    const trace::record& r = records[i];
+    (r.direction == trace::SENT ? sent : received) += r.data.length();
+
+    for(unsigned line = 0; line < r.data.length(); line += 16) {
+      if(line == 0) {
+        out << fixed << setprecision(3) << setw(12) << setfill(' ')
+            << (r.time - records[0].time) / 1000.0 << " ms " << r.direction << " ";
+      } else {
+        out << string(20, ' ');
+      }
+
+      string ascii;
+      for(unsigned k = line; k < line + 16; k++) {
+        if(k < r.data.length()) {
+          unsigned char chr = r.data[k];
+          out << hex << setw(2) << setfill('0') << unsigned(chr) << dec << " ";
+          ascii += (chr >= 0x20 && chr < 0x7f) ? char(chr) : '.';
+        } else {
+          out << "   ";
+        }
+      }
+      out << " " << ascii << endl;
+    }
+  }
+
+  out << sent << " bytes sent, " << received << " bytes received";
+  if(!records.empty()) {
+    out << " in " << fixed << setprecision(3)
+        << (records.back().time - records[0].time) / 1000.0 << " ms";
+  }
+  out << "." << endl;
+
+  return true;
+}
+
+bool trace_replay(string filename, ostream& out) {
+  vector<trace::record> records;
+  unsigned dropped;
+  if(!trace::load(filename, records, dropped)) {
+    cerr << "cannot read trace `" << filename << "'!" << endl;
+    return false;
+  }
+
+  if(dropped > 0) {
+    cerr << "trace is incomplete; it cannot be replayed!" << endl;
+    return false;
+  }
+
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if(master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+    cerr << "cannot create pseudo-terminal!" << endl;
+    return false;
+  }
+
+  // until the host opens the terminal, keep it open here, so that reads
+  // do not fail and settings are not lost
+  int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  termios settings;
+  if(slave == -1 || tcgetattr(slave, &settings) == -1) {
+    cerr << "cannot open pseudo-terminal!" << endl;
+    return false;
+  }
+  cfmakeraw(&settings);
+  tcsetattr(slave, TCSANOW, &settings);
+
+  out << ptsname(master) << endl;
+
+  bool success = true;
+  for(unsigned i = 0; i < records.size() && success; i++) {
+    const trace::record& r = records[i];
+
+    if(r.direction == trace::SENT) {
+      string data;
+      while(data.length() < r.data.length()) {
+        char buffer[4096];
+        int retval = read(master, buffer, min(sizeof(buffer), r.data.length() - data.length()));
+        if(retval <= 0) {
+          if(retval == -1 && errno == EINTR)
+            continue;
+          cerr << "host closed the port at record " << i << "!" << endl;
+          success = false;
+          break;
+        }
+        data.append(buffer, retval);
+
+        if(slave != -1) {
+          close(slave);
+          slave = -1;
+        }
+      }
+
+      if(success && data != r.data) {
+        unsigned at = 0;
+        while(data[at] == r.data[at])
+          at++;
+        cerr << "host diverged from trace at record " << i << ", byte " << at << ": "
+             << hex << setfill('0') << "expected " << setw(2) << unsigned((unsigned char) r.data[at])
+             << ", got " << setw(2) << unsigned((unsigned char) data[at]) << dec << "!" << endl;
+        success = false;
+      }
+    } else {
+      if(i > 0) {
+        long long delay = r.time - records[i - 1].time;
+        if(delay > MAX_DELAY)
+          delay = MAX_DELAY;
+        if(delay > 0)
+          usleep(delay);
+      }
+
+      for(unsigned done = 0; done < r.data.length(); ) {
+        int retval = write(master, r.data.data() + done, r.data.length() - done);
+        if(retval == -1) {
+          if(errno == EINTR)
+            continue;
+          cerr << "cannot write to pseudo-terminal!" << endl;
+          success = false;
+          break;
+        }
+        done += retval;
+      }
+    }
+  }
+
+  // wait for the host to finish; anything it sends now is unexpected
+  if(success) {
+    char buffer[4096];
+    int retval;
+    while((retval = read(master, buffer, sizeof(buffer))) != 0) {
+      if(retval == -1) {
+        if(errno == EINTR)
+          continue;
+        break;
+      }
+      cerr << "host sent " << retval << " bytes after the end of trace!" << endl;
+      success = false;
+    }
+  }
+
+  if(slave != -1)
+    close(slave);
+  close(master);
+
+  if(success)
+    cerr << "Replayed " << records.size() << " records." << endl;
+  return success;
+}
+
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2010 Peter Zotov <whitequark@whitequark.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+namespace vux {
+
+// Raw protocol trace. Bytes are appended to a fixed-size ring in memory,
+// so that tracing does not disturb timing; when the ring is full, oldest
+// records are dropped. The ring is written to a file when done.
+//
+// A trace file starts with "VXTR", a version byte and the count of
+// dropped records (32 bits), followed by records: timestamp in
+// microseconds (64 bits), direction byte, length (16 bits) and data.
+// All numbers are little-endian.
+class trace {
+public:
+  enum direction {
+    SENT = '>',
+    RECEIVED = '<'
+  };
+
+  struct record {
+    long long time;
+    char direction;
+    std::string data;
+  };
+
+  trace(unsigned capacity = 4 << 20);
+
+  void add(char direction, long long time, const char* data, unsigned length);
+
+  bool save(std::string filename);
+  static bool load(std::string filename, std::vector<record>& records, unsigned& dropped);
+
+private:
+  static const unsigned HEADER_BYTES = 11;
+
+  void put(const char* data, unsigned length);
+  void get(unsigned offset, char* data, unsigned length);
+
+  std::vector<char> _ring;
+  unsigned _head, _used, _dropped;
+};
+
+// Prints a trace file in human-readable form.
+bool trace_print(std::string filename, std::ostream& out);
+
+// Plays the device side of a trace on a pseudo-terminal, which name is
+// printed to `out'. Fails if the host sends something else than it did
+// when the trace was recorded.
+bool trace_replay(std::string filename, std::ostream& out);
+
+}
+
+#endif
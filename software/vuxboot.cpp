@@ -0,0 +1,1732 @@
+/*
+ * Copyright (c) 2010 Peter Zotov <whitequark@whitequark.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include "serial.h"
+#include "trace.h"
+#include "vuxboot.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <elf.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+
+using namespace std;
+
+namespace vux {
+
+typedef unsigned char byte;
+typedef unsigned short word;
+
+error::error(string message, kind_type kind) : _message(message), _kind(kind) {}
+
+error::~error() throw() {}
+
+string error::message() const {
+  return _message;
+}
+
+error::kind_type error::kind() const {
+  return _kind;
+}
+
+const char* error::what() const throw() {
+  return _message.c_str();
+}
+
+io_error::io_error(string message) : error(message, IO) {}
+
+feature_error::feature_error(string message) : error(message, FEATURE) {}
+
+hardware_error::hardware_error(string message) : error(message, HARDWARE) {}
+
+input_error::input_error(string message) : error(message, INPUT) {}
+
+static string protocol_message(string info, string node) {
+  string message = info;
+  if(node != "")
+    message += ": `" + node + "'";
+  return message;
+}
+
+protocol_error::protocol_error(string info, string node) :
+      error(protocol_message(info, node), PROTOCOL) {}
+
+unsigned crc32(const char* data, unsigned length) {
+  unsigned crc = 0xffffffff;
+  for(unsigned i = 0; i < length; i++) {
+    crc ^= byte(data[i]);
+    for(int j = 0; j < 8; j++)
+      crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320 : 0);
+  }
+  return ~crc;
+}
+
+unsigned crc32(string data) {
+  return crc32(data.data(), data.length());
+}
+
+unsigned crc16(string data) {
+  unsigned crc = 0;
+  for(unsigned i = 0; i < data.length(); i++) {
+    crc ^= byte(data[i]);
+    for(int j = 0; j < 8; j++)
+      crc = (crc >> 1) ^ (crc & 1 ? 0x8408 : 0);
+  }
+  return crc;
+}
+
+memory_image::memory_image(unsigned page_bytes) :
+      _page_bytes(page_bytes), _length(0) {}
+
+memory_image::memory_image(const char* data, unsigned length, unsigned page_bytes) :
+      _page_bytes(page_bytes), _length(0) {
+  write(0, data, length);
+}
+
+unsigned memory_image::page_bytes() const {
+  return _page_bytes;
+}
+
+unsigned memory_image::length() const {
+  return _length;
+}
+
+unsigned memory_image::pages() const {
+  return (_length + _page_bytes - 1) / _page_bytes;
+}
+
+const char* memory_image::data() const {
+  return _data.empty() ? NULL : &_data[0];
+}
+
+const char* memory_image::page(unsigned index) const {
+  return &_data[index * _page_bytes];
+}
+
+bool memory_image::present(unsigned index) const {
+  return index < _present.size() && _present[index];
+}
+
+bool memory_image::blank(unsigned index) const {
+  return index >= _blank.size() || _blank[index];
+}
+
+bool memory_image::dirty(unsigned index) const {
+  return index < _dirty.size() && _dirty[index];
+}
+
+void memory_image::clean() {
+  _dirty.assign(_dirty.size(), false);
+}
+
+bool memory_image::same(unsigned index, const char* data) const {
+  return memcmp(page(index), data, _page_bytes) == 0;
+}
+
+string memory_image::bytes(unsigned addr, unsigned length) const {
+  string result(length, 0xff);
+  if(addr < _length)
+    result.replace(0, min(length, _length - addr), &_data[addr], min(length, _length - addr));
+  return result;
+}
+
+void memory_image::write(unsigned addr, const char* data, unsigned length) {
+  if(length == 0)
+    return;
+  if(addr > MAX_BYTES || length > MAX_BYTES - addr)
+    throw input_error("image data beyond 16 MiB");
+
+  extend(addr + length);
+  memcpy(&_data[addr], data, length);
+
+  for(unsigned index = addr / _page_bytes; index <= (addr + length - 1) / _page_bytes; index++) {
+    _present[index] = _dirty[index] = true;
+    _blank[index] = blank_bytes(page(index), _page_bytes);
+  }
+}
+
+void memory_image::extend(unsigned length) {
+  if(length <= _length)
+    return;
+  if(length > MAX_BYTES)
+    throw input_error("image data beyond 16 MiB");
+
+  unsigned pages = (length + _page_bytes - 1) / _page_bytes;
+  if(pages > _present.size()) {
+    _data.resize(pages * _page_bytes, 0xff);
+    _present.resize(pages, false);
+    _blank.resize(pages, true);
+    _dirty.resize(pages, false);
+  }
+  _length = length;
+}
+
+void memory_image::repage(unsigned page_bytes) {
+  if(page_bytes == _page_bytes)
+    return;
+
+  unsigned pages = (_data.size() + page_bytes - 1) / page_bytes;
+  vector<bool> present(pages, false), blank(pages, true), dirty(pages, false);
+  for(unsigned index = 0; index < _present.size(); index++) {
+    unsigned first = index * _page_bytes / page_bytes,
+             last = ((index + 1) * _page_bytes - 1) / page_bytes;
+    for(unsigned k = first; k <= last; k++) {
+      present[k] = present[k] || _present[index];
+      dirty[k] = dirty[k] || _dirty[index];
+    }
+  }
+
+  _data.resize(pages * page_bytes, 0xff);
+  _page_bytes = page_bytes;
+  for(unsigned index = 0; index < pages; index++)
+    blank[index] = blank_bytes(page(index), _page_bytes);
+
+  _present.swap(present);
+  _blank.swap(blank);
+  _dirty.swap(dirty);
+}
+
+bool memory_image::blank_bytes(const char* data, unsigned length) {
+  const char* end = data + length;
+  for(; data + sizeof(unsigned long) <= end; data += sizeof(unsigned long)) {
+    unsigned long value;
+    memcpy(&value, data, sizeof(value));
+    if(value != ~0UL)
+      return false;
+  }
+  for(; data < end; data++) {
+    if(byte(*data) != 0xff)
+      return false;
+  }
+  return true;
+}
+
+long long monotonic_us() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+string json_string(string text) {
+  string result = "\"";
+  for(int i = 0; i < text.length(); i++) {
+    char chr = text[i];
+    if(chr == '"' || chr == '\\') {
+      result += '\\';
+      result += chr;
+    } else if((unsigned char) chr < 0x20) {
+      char escape[7];
+      sprintf(escape, "\\u%04x", chr);
+      result += escape;
+    } else {
+      result += chr;
+    }
+  }
+  return result + "\"";
+}
+
+stats::stats(string tag, ostream* stream) :
+      _tag(tag), _stream(stream), _start(monotonic_us()), _sent(0), _received(0), _pages_read(0), _pages_written(0), _pages_skipped(0), _retransmits(0) {}
+
+void stats::sent(unsigned bytes) {
+  _sent += bytes;
+}
+
+void stats::received(unsigned bytes) {
+  _received += bytes;
+}
+
+void stats::pages_read(unsigned count) {
+  _pages_read += count;
+}
+
+void stats::pages_written(unsigned count) {
+  _pages_written += count;
+}
+
+void stats::pages_skipped(unsigned count) {
+  _pages_skipped += count;
+}
+
+void stats::retransmitted(unsigned count) {
+  _retransmits += count;
+}
+
+unsigned long long stats::bytes() {
+  return (unsigned long long) _sent + _received;
+}
+
+unsigned stats::pages() {
+  return _pages_read + _pages_written;
+}
+
+unsigned stats::requests() {
+  unsigned count = 0;
+  for(map<char, latency>::iterator it = _latency.begin(); it != _latency.end(); ++it)
+    count += it->second.count;
+  return count;
+}
+
+void stats::command(char command, long long start) {
+  long long elapsed = monotonic_us() - start;
+
+  latency& l = _latency[command];
+  if(l.count == 0 || elapsed < l.min)
+    l.min = elapsed;
+  if(elapsed > l.max)
+    l.max = elapsed;
+  l.total += elapsed;
+  l.count++;
+
+  int bucket = 0;
+  while(bucket < BUCKETS - 1 && elapsed >= BUCKET_LIMITS[bucket])
+    bucket++;
+  l.histogram[bucket]++;
+}
+
+void stats::phase(string name, long long start) {
+  long long elapsed = monotonic_us() - start;
+  if(_phases.find(name) == _phases.end())
+    _phase_order.push_back(name);
+  _phases[name] += elapsed;
+
+  ostringstream event;
+  event << fixed << setprecision(3);
+  event << "{\"port\": " << json_string(_tag) << ", \"phase\": " << json_string(name)
+        << ", \"ms\": " << elapsed / 1000.0 << "}";
+  emit(event.str());
+}
+
+string stats::finish(bool success) {
+  long long elapsed = monotonic_us() - _start;
+
+  ostringstream json;
+  json << fixed << setprecision(3);
+  json << "{\"port\": " << json_string(_tag) << ", "
+       << "\"result\": " << (success ? "\"ok\"" : "\"failed\"") << ", "
+       << "\"ms\": " << elapsed / 1000.0 << ", "
+       << "\"bytes_sent\": " << _sent << ", "
+       << "\"bytes_received\": " << _received << ", "
+       << "\"bytes_per_second\": " << (elapsed > 0 ? (_sent + _received) * 1e6 / elapsed : 0) << ", "
+       << "\"pages\": {\"read\": " << _pages_read << ", \"written\": " << _pages_written
+       << ", \"skipped\": " << _pages_skipped << "}, "
+       << "\"retransmits\": " << _retransmits << ", ";
+
+  json << "\"phases_ms\": {";
+  for(int i = 0; i < _phase_order.size(); i++) {
+    json << (i ? ", " : "") << json_string(_phase_order[i]) << ": "
+         << _phases[_phase_order[i]] / 1000.0;
+  }
+  json << "}, ";
+
+  json << "\"commands\": {";
+  for(map<char, latency>::iterator it = _latency.begin(); it != _latency.end(); ++it) {
+    latency& l = it->second;
+    json << (it == _latency.begin() ? "" : ", ") << json_string(string(1, it->first)) << ": {"
+         << "\"count\": " << l.count << ", "
+         << "\"avg_ms\": " << l.total / l.count / 1000.0 << ", "
+         << "\"min_ms\": " << l.min / 1000.0 << ", "
+         << "\"max_ms\": " << l.max / 1000.0 << ", "
+         << "\"histogram\": {";
+    for(int i = 0; i < BUCKETS; i++) {
+      json << (i ? ", " : "") << "\"";
+      if(i < BUCKETS - 1)
+        json << "<" << BUCKET_LIMITS[i] << "us";
+      else
+        json << ">=" << BUCKET_LIMITS[i - 1] << "us";
+      json << "\": " << l.histogram[i];
+    }
+    json << "}}";
+  }
+  json << "}}";
+
+  emit(json.str());
+  return json.str();
+}
+
+void stats::describe_latency(ostream& out) {
+  for(map<char, latency>::iterator it = _latency.begin(); it != _latency.end(); ++it) {
+    latency& l = it->second;
+    out << "  " << it->first << ": " << l.count << " requests, " << fixed << setprecision(2)
+        << "avg " << l.total / l.count / 1000.0 << " ms, "
+        << "min " << l.min / 1000.0 << " ms, "
+        << "max " << l.max / 1000.0 << " ms." << endl;
+  }
+}
+
+// sessions of parallel runs may share a stream
+static pthread_mutex_t emit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void stats::emit(string line) {
+  if(_stream == NULL)
+    return;
+
+  pthread_mutex_lock(&emit_lock);
+  *_stream << line << endl;
+  pthread_mutex_unlock(&emit_lock);
+}
+
+const long long stats::BUCKET_LIMITS[] = {
+  100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000,
+  100000, 200000, 500000, 1000000
+};
+
+vuxboot::vuxboot(string filename, unsigned baud, stats* st) :
+      _debug(false), _stats(st ? st : &_own_stats), _trace(NULL), _listener(NULL),
+      _baud(0), _has_eeprom(false), _eeprom_bytes(0), _features(0), _framed(false),
+      _sequence(0), _pending(0), _in_flight(0), _batch_done(0), _batch_total(0) {
+  _fd = open(filename.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if(_fd < 0) throw io_error("cannot open port");
+
+  // All I/O is non-blocking and driven by epoll; see poll().
+  // the destructor does not run if we throw, so close what is open
+  _epoll = epoll_create(1);
+  if(_epoll < 0) {
+    close(_fd);
+    throw io_error("cannot epoll_create()");
+  }
+
+  epoll_event ev = {0};
+  ev.events = _events = EPOLLIN;
+  ev.data.fd = _fd;
+  if(epoll_ctl(_epoll, EPOLL_CTL_ADD, _fd, &ev) == -1) {
+    close(_epoll);
+    close(_fd);
+    throw io_error("cannot epoll_ctl()");
+  }
+
+  // Serial initialization was written with FTDI USB-to-serial converters
+  // in mind. Anyway, who wants to use non-8n1 protocol?
+
+  tcgetattr(_fd, &_termios);
+
+  termios tio = {0};
+  tio.c_iflag = IGNPAR;
+  tio.c_oflag = 0;
+  tio.c_cflag = baud | CLOCAL | CREAD | CS8;
+  tio.c_lflag = 0;
+  tio.c_cc[VMIN] = 1;
+  tio.c_cc[VTIME] = 0;
+  _settings = tio;
+
+  tcflush(_fd, TCIFLUSH);
+  tcsetattr(_fd, TCSANOW, &tio);
+
+  // FTDI adapters otherwise hold small replies for up to 16ms
+  _low_latency = serial_set_low_latency(_fd, true, _was_low_latency);
+}
+
+vuxboot::~vuxboot() {
+  try {
+    // a device left at a custom rate would not talk to the next run
+    if(_baud != 0)
+      switch_baud(0);
+    // hosts which do not frame packets must still be understood
+    if(_framed)
+      set_framed(false);
+    drain(1);
+  } catch(error& e) {
+    // the device is gone; nothing to do about it
+  }
+
+  if(_low_latency && !_was_low_latency)
+    serial_set_low_latency(_fd, false, _was_low_latency);
+
+  tcsetattr(_fd, TCSANOW, &_termios);
+  close(_epoll);
+  close(_fd);
+}
+
+bool vuxboot::get_debug() {
+  return _debug;
+}
+
+void vuxboot::set_debug(bool new_debug) {
+  _debug = new_debug;
+}
+
+void vuxboot::set_trace(trace* new_trace) {
+  _trace = new_trace;
+}
+
+void vuxboot::set_statistics(stats* st) {
+  _stats = st ? st : &_own_stats;
+}
+
+void vuxboot::set_listener(vuxboot_listener* new_listener) {
+  _listener = new_listener;
+}
+
+void vuxboot::identify() {
+  long long start = monotonic_us();
+  write("s");
+
+  // an unknown number of unknown characters may appear because of
+  // input buffer flushing when rebooting device
+  string s;
+  do {
+    s = read(1);
+  } while(s[0] != SIGNATURE[0]);
+
+  string signature = s + read(2); // one non-E plus two symbols
+  if(signature != SIGNATURE)
+    throw protocol_error("wrong signature", signature);
+
+  string s_type = read(1);
+  if(s_type != "f" && s_type != "e")
+    throw protocol_error("wrong type", s_type);
+
+  _has_eeprom = (s_type == "e");
+  if(_has_eeprom) {
+    string s_eesize = read(1);
+    _eeprom_bytes = 1 << s_eesize[0];
+    s_type += s_eesize;
+  }
+
+  string s_flash_sizes = read(3);
+  _page_words = byte(s_flash_sizes[0]);
+  _flash_pages = 1 << byte(s_flash_sizes[1]);
+  _boot_pages = byte(s_flash_sizes[2]);
+
+  string s_checksum = read(1);
+
+  string concat = signature + s_type + s_flash_sizes;
+  char checksum = 0;
+  for(int i = 0; i < concat.length(); i++)
+    checksum += concat[i];
+
+  if(checksum != s_checksum[0])
+    throw protocol_error("bad checksum");
+
+  _stats->command('s', start);
+
+  // bootloaders predating `v' answer it with `E'
+  start = monotonic_us();
+  write("v");
+  read_features();
+  _stats->command('v', start);
+}
+
+void vuxboot::set_framed(bool framed) {
+  if(!has_feature(FEATURE_FRAMED))
+    throw feature_error("no framed mode");
+
+  flush_flash();
+
+  // neither the request nor its reply is framed
+  _framed = false;
+
+  // it does no harm to repeat the request
+  string req = "f";
+  req += char(framed);
+  req += char(framed ^ 0xff);
+  for(unsigned attempt = 1; ; attempt++) {
+    try {
+      if(request(req, 1) == ".")
+        break;
+    } catch(io_error& e) {
+      // lost bytes; resynchronize below
+    }
+
+    if(attempt == RETRIES)
+      throw protocol_error("cannot switch framed mode");
+    _stats->retransmitted(1);
+    resync();
+  }
+
+  _framed = framed;
+}
+
+bool vuxboot::framed() {
+  return _framed;
+}
+
+void vuxboot::describe(ostream& out) {
+  out << "Device capabilities:" << endl;
+  if(_has_eeprom)
+    out << "  EEPROM: " << _eeprom_bytes << " bytes." << endl;
+  out << "  Page size: " << _page_words << " words." << endl;
+  out << "  Flash size: " << _flash_pages << " pages." << endl;
+  out << "  Reserved area: " << _boot_pages << " pages (at end)." << endl;
+  if(has_feature(FEATURE_PIPELINE))
+    out << "  Pipelined writes: " << flash_window() << " pages in flight." << endl;
+  if(has_feature(FEATURE_RLE))
+    out << "  Compressed writes." << endl;
+  if(_framed)
+    out << "  Framed packets." << endl;
+  if(has_feature(FEATURE_BAUD))
+    out << "  Clock: " << _f_cpu << " Hz." << endl;
+}
+
+string vuxboot::read_flash(unsigned page) {
+  if(page > flash_pages())
+    throw input_error("flash page address too big");
+
+  flush_flash();
+
+  string req = "r";
+  req += char(page & 0xff);
+  req += char(page >> 8);
+
+  _stats->pages_read(1);
+  return request(req, _page_words * 2);
+}
+
+void vuxboot::read_flash_range(unsigned first, unsigned count, memory_image& into) {
+  if(first + count > flash_pages())
+    throw input_error("flash page range too big");
+  if(into.page_bytes() != _page_words * 2)
+    throw error("flash page size mismatch");
+
+  if(!has_feature(FEATURE_BULK_READ)) {
+    for(unsigned page = first; page < first + count; page++) {
+      into.write(page * _page_words * 2, read_flash(page).data(), _page_words * 2);
+      notify("flash_read", page - first + 1, count);
+    }
+    return;
+  }
+
+  flush_flash();
+
+  unsigned total = count;
+  while(count > 0) {
+    unsigned chunk = min(count, max_items(_page_words * 2));
+
+    string req = "b";
+    req += char(first & 0xff);
+    req += char(first >> 8);
+    req += char(chunk & 0xff);
+    req += char(chunk >> 8);
+    string data = request(req, chunk * _page_words * 2);
+    into.write(first * _page_words * 2, data.data(), data.length());
+    _stats->pages_read(chunk);
+
+    first += chunk;
+    count -= chunk;
+    notify("flash_read", total - count, total);
+  }
+}
+
+vector<unsigned> vuxboot::crc_flash_range(unsigned first, unsigned count) {
+  if(!has_feature(FEATURE_CRC))
+    throw feature_error("no flash checksums");
+  if(first + count > flash_pages())
+    throw input_error("flash page range too big");
+
+  flush_flash();
+
+  vector<unsigned> crcs;
+  unsigned total = count;
+  while(count > 0) {
+    unsigned chunk = min(count, max_items(4));
+
+    string req = "c";
+    req += char(first & 0xff);
+    req += char(first >> 8);
+    req += char(chunk & 0xff);
+    req += char(chunk >> 8);
+    string s_crcs = request(req, chunk * 4);
+    for(unsigned i = 0; i < chunk * 4; i += 4) {
+      crcs.push_back(byte(s_crcs[i]) | (byte(s_crcs[i + 1]) << 8) |
+            (byte(s_crcs[i + 2]) << 16) | (byte(s_crcs[i + 3]) << 24));
+    }
+
+    first += chunk;
+    count -= chunk;
+    notify("flash_crc", total - count, total);
+  }
+
+  return crcs;
+}
+
+void vuxboot::write_flash(unsigned page, const char* words) {
+  flush_flash();
+
+  string req = "w";
+  req.append(words, _page_words * 2);
+  req += char(page & 0xff);
+  req += char(page >> 8);
+
+  if(request(req, 1) != ".")
+    throw hardware_error("cannot write flash");
+  _stats->pages_written(1);
+}
+
+void vuxboot::queue_flash(unsigned page, const char* words) {
+  if(!has_feature(FEATURE_PIPELINE)) {
+    write_flash(page, words);
+    return;
+  }
+
+  string req = "p", packed;
+  if(has_feature(FEATURE_RLE))
+    packed = rle_encode(words, _page_words);
+  if(packed != "" && packed.length() < _page_words * 2) {
+    req = "z";
+    req += char(_sequence);
+    req += packed;
+  } else {
+    req += char(_sequence);
+    req.append(words, _page_words * 2);
+  }
+  req += char(page & 0xff);
+  req += char(page >> 8);
+  if(_framed)
+    req = frame(req);
+
+  while(_pending > 0 && _in_flight + req.length() > flash_window() * page_packet_bytes())
+    wait_flash(1);
+
+  write(req);
+
+  packet sent = { req, page, char(_sequence), monotonic_us() };
+  _sent.push_back(sent);
+  _in_flight += req.length();
+  _sequence++;
+  _pending++;
+  _stats->pages_written(1);
+}
+
+void vuxboot::flush_flash() {
+  wait_flash(_pending);
+}
+
+void vuxboot::write_pages(const memory_image& image, const vector<unsigned>& pages) {
+  if(image.page_bytes() != _page_words * 2)
+    throw error("flash page size mismatch");
+
+  flush_flash();
+
+  _batch_done = 0;
+  _batch_total = pages.size();
+  try {
+    for(unsigned i = 0; i < pages.size(); i++)
+      queue_flash(pages[i], image.page(pages[i]));
+    flush_flash();
+  } catch(...) {
+    _batch_total = 0;
+    throw;
+  }
+  _batch_total = 0;
+}
+
+void vuxboot::erase_flash(unsigned first, unsigned count) {
+  if(first + count > flash_pages())
+    throw input_error("flash page range too big");
+
+  if(!has_feature(FEATURE_ERASE)) {
+    string blank(_page_words * 2, 0xff);
+    for(unsigned page = first; page < first + count; page++)
+      queue_flash(page, blank.data());
+    flush_flash();
+    notify("flash_erase", count, count);
+    return;
+  }
+
+  flush_flash();
+
+  unsigned total = count;
+  while(count > 0) {
+    unsigned chunk = count > 0xffff ? 0xffff : count;
+
+    string req = "x";
+    req += char(first & 0xff);
+    req += char(first >> 8);
+    req += char(chunk & 0xff);
+    req += char(chunk >> 8);
+
+    // page erase takes ~4ms; allow for slower parts
+    if(request(req, 1, 5 + chunk / 100) != ".")
+      throw hardware_error("cannot erase flash");
+
+    first += chunk;
+    count -= chunk;
+    notify("flash_erase", total - count, total);
+  }
+}
+
+string vuxboot::read_eeprom() {
+  if(!_has_eeprom)
+    throw feature_error("no eeprom");
+
+  flush_flash();
+
+  string data = request("R", _eeprom_bytes);
+  notify("eeprom_read", _eeprom_bytes, _eeprom_bytes);
+  return data;
+}
+
+string vuxboot::read_eeprom(unsigned address, unsigned length) {
+  if(!_has_eeprom)
+    throw feature_error("no eeprom");
+  if(address + length > _eeprom_bytes)
+    throw input_error("eeprom range too big");
+
+  if(!has_feature(FEATURE_EEPROM_RANGE))
+    return read_eeprom().substr(address, length);
+  if(length == 0)
+    return "";
+
+  flush_flash();
+
+  string data;
+  unsigned total = length;
+  while(length > 0) {
+    unsigned chunk = min(length, max_items(1));
+
+    string req = "B";
+    req += char(address & 0xff);
+    req += char(address >> 8);
+    req += char(chunk & 0xff);
+    req += char(chunk >> 8);
+    data += request(req, chunk);
+
+    address += chunk;
+    length -= chunk;
+    notify("eeprom_read", total - length, total);
+  }
+
+  return data;
+}
+
+void vuxboot::write_eeprom(unsigned address, byte b) {
+  if(!_has_eeprom)
+    throw feature_error("no eeprom");
+  if(address > _eeprom_bytes)
+    throw input_error("eeprom address too big");
+
+  flush_flash();
+
+  string req = "W";
+  req += char(address & 0xff);
+  req += char(address >> 8);
+  req += char(b);
+
+  if(request(req, 1) != ".")
+    throw hardware_error("cannot write eeprom");
+}
+
+void vuxboot::write_eeprom_block(unsigned address, string data) {
+  if(!_has_eeprom)
+    throw feature_error("no eeprom");
+  if(address + data.length() > _eeprom_bytes)
+    throw input_error("eeprom address too big");
+
+  // blocks are not accepted in framed mode, as the device would write
+  // them before checking their CRC; a ring too small for the header
+  // leaves no room for data
+  if(!has_feature(FEATURE_EEPROM_BLOCK) || _framed || _ring_bytes <= 6) {
+    for(unsigned i = 0; i < data.length(); i++) {
+      write_eeprom(address + i, data[i]);
+      notify("eeprom_write", i + 1, data.length());
+    }
+    return;
+  }
+
+  flush_flash();
+
+  unsigned max_chunk = _ring_bytes - 6;
+  for(unsigned offset = 0; offset < data.length(); offset += max_chunk) {
+    string chunk = data.substr(offset, max_chunk);
+    unsigned chunk_address = address + offset;
+
+    string req = "P";
+    req += char(chunk_address & 0xff);
+    req += char(chunk_address >> 8);
+    req += char(chunk.length() & 0xff);
+    req += char(chunk.length() >> 8);
+    req += chunk;
+
+    // eeprom write takes ~8.5ms per byte
+    if(request(req, 1, 5 + chunk.length() / 100) != ".")
+      throw hardware_error("cannot write eeprom");
+    notify("eeprom_write", offset + chunk.length(), data.length());
+  }
+}
+
+bool vuxboot::switch_baud(unsigned rate) {
+  if(!has_feature(FEATURE_BAUD))
+    throw feature_error("no baud rate switching");
+
+  unsigned ubrr = 0xffff, actual = 0;
+  bool u2x = false;
+  if(rate != 0) {
+    actual = baud_divisor(rate, ubrr, u2x);
+    if(actual == 0)
+      throw input_error("baud rate cannot be achieved with device clock");
+  }
+
+  flush_flash();
+
+  string req = "u";
+  req += char(ubrr & 0xff);
+  req += char(ubrr >> 8);
+  req += char(u2x);
+
+  if(request(req, 1) != ".")
+    throw protocol_error("cannot switch baud rate");
+
+  if(set_baud(actual)) {
+    write("u");
+    try {
+      if(read(1, 1) == "U") {
+        _baud = actual;
+        return true;
+      }
+    } catch(io_error& e) {
+      // fall back below
+    }
+  }
+
+  // Wait for the device to give up, then check that it did; if it got
+  // `u' but its reply was lost, it stays at the new rate.
+  unsigned previous = _baud;
+
+  set_baud(0);
+  usleep(600000);
+  if(ping()) {
+    _baud = 0;
+    return rate == 0;
+  }
+
+  unsigned stuck = rate != 0 ? actual : previous;
+  if(stuck != 0 && set_baud(stuck) && ping()) {
+    _baud = stuck;
+    return rate != 0;
+  }
+
+  throw io_error("lost device after baud rate switch");
+}
+
+void vuxboot::reset() {
+  flush_flash();
+
+  write(_framed ? frame("q") : "q");
+
+  // the bootloader starts at the power-on rate and unframed again
+  _baud = 0;
+  _framed = false;
+}
+
+bool vuxboot::has_eeprom() {
+  return _has_eeprom;
+}
+
+unsigned vuxboot::eeprom_bytes() {
+  return _eeprom_bytes;
+}
+
+unsigned vuxboot::flash_pages() {
+  return _flash_pages;
+}
+
+unsigned vuxboot::boot_pages() {
+  return _boot_pages;
+}
+
+unsigned vuxboot::page_words() {
+  return _page_words;
+}
+
+string vuxboot::identity() {
+  ostringstream id;
+  id << _page_words << "w" << _flash_pages << "p" << _boot_pages << "b";
+  if(_has_eeprom)
+    id << _eeprom_bytes << "e";
+  return id.str();
+}
+
+unsigned vuxboot::baud() {
+  return _baud;
+}
+
+bool vuxboot::low_latency() {
+  return _low_latency;
+}
+
+void vuxboot::describe_latency(ostream& out) {
+  out << "Command latency" << (_low_latency ? " (low latency mode):" : ":") << endl;
+  _stats->describe_latency(out);
+}
+
+stats& vuxboot::statistics() {
+  return *_stats;
+}
+
+bool vuxboot::has_feature(feature f) {
+  return (_features & f) != 0;
+}
+
+unsigned vuxboot::flash_window() {
+  if(!has_feature(FEATURE_PIPELINE))
+    return 1;
+
+  unsigned window = (_ring_bytes - 1) / page_packet_bytes();
+  return window > 0 ? window : 1;
+}
+
+string vuxboot::read(unsigned length, unsigned timeout) {
+  // long replies take their time on the line; only silence is an error
+  long long deadline = monotonic_us() + timeout * 1000000LL;
+  unsigned received = _input.length();
+  while(_input.length() < length) {
+    poll(deadline);
+    if(_input.length() > received) {
+      received = _input.length();
+      deadline = monotonic_us() + timeout * 1000000LL;
+    }
+  }
+
+  string data = _input.substr(0, length);
+  _input.erase(0, length);
+
+  if(_debug) {
+    cerr << "read(" << length << "): {";
+    for(int i = 0; i < data.length(); i++) {
+      char val[3];
+      sprintf(val, "%02X", (unsigned char) data[i]);
+      cerr << val << ' ';
+    }
+    for(int i = 0; i < data.length(); i++) {
+      char chr = data[i];
+      if(isgraph(chr))
+        cerr << chr;
+      else
+        cerr << '.';
+    }
+    cerr << "}" << endl;
+  }
+
+  return data;
+}
+
+void vuxboot::write(string data) {
+  if(_debug) {
+    cerr << "write(" << data.length() << "): {";
+    for(int i = 0; i < data.length(); i++) {
+      char val[3];
+      sprintf(val, "%02X", (unsigned char) data[i]);
+      if(i != 0)
+        cerr << ' ';
+      cerr << val;
+    }
+    cerr << ' ';
+    for(int i = 0; i < data.length(); i++) {
+      char chr = data[i];
+      if(isgraph(chr))
+        cerr << chr;
+      else
+        cerr << '.';
+    }
+    cerr << "}" << endl;
+  }
+
+  _output += data;
+  transmit();
+}
+
+void vuxboot::drain(unsigned timeout) {
+  long long deadline = monotonic_us() + timeout * 1000000LL;
+  while(!_output.empty())
+    poll(deadline);
+}
+
+void vuxboot::read_features() {
+  string s_features = read(1);
+  if(s_features == "v") {
+    s_features = read(3);
+    _features = byte(s_features[0]) | (byte(s_features[1]) << 8);
+    _ring_bytes = 1 << s_features[2];
+
+    if(has_feature(FEATURE_BAUD)) {
+      string s_f_cpu = read(4);
+      _f_cpu = byte(s_f_cpu[0]) | (byte(s_f_cpu[1]) << 8) |
+            (byte(s_f_cpu[2]) << 16) | (byte(s_f_cpu[3]) << 24);
+    }
+  } else if(s_features == "E") {
+    _features = 0;
+  } else {
+    throw protocol_error("wrong features", s_features);
+  }
+}
+
+bool vuxboot::ping() {
+  tcflush(_fd, TCIOFLUSH);
+  _input.clear();
+  _output.clear();
+
+  try {
+    write("v");
+    read_features();
+    return true;
+  } catch(io_error& e) {
+    return false;
+  } catch(protocol_error& e) {
+    return false;
+  }
+}
+
+bool vuxboot::set_baud(unsigned rate) {
+  drain();
+  tcdrain(_fd);
+
+  bool success;
+  if(rate == 0)
+    success = tcsetattr(_fd, TCSANOW, &_settings) == 0;
+  else
+    success = serial_set_baud(_fd, rate);
+
+  tcflush(_fd, TCIFLUSH);
+  _input.clear();
+  return success;
+}
+
+unsigned vuxboot::baud_divisor(unsigned rate, unsigned& ubrr, bool& u2x) {
+  unsigned best = 0;
+  for(int i = 0; i < 2; i++) {
+    unsigned divisor = i ? 8 : 16;
+    unsigned prescale = (_f_cpu + divisor * rate / 2) / (divisor * rate);
+    if(prescale == 0 || prescale > 4096)
+      continue;
+
+    unsigned actual = _f_cpu / (divisor * prescale);
+    unsigned error = actual > rate ? actual - rate : rate - actual;
+    if(error * 50 > rate)
+      continue;
+
+    unsigned best_error = best > rate ? best - rate : rate - best;
+    if(best == 0 || error < best_error) {
+      best = actual;
+      ubrr = prescale - 1;
+      u2x = i;
+    }
+  }
+  return best;
+}
+
+string vuxboot::request(string req, unsigned length, unsigned timeout) {
+  long long start = monotonic_us();
+  if(!_framed) {
+    write(req);
+    string reply = read(length, timeout);
+    _stats->command(req[0], start);
+    return reply;
+  }
+
+  string packet = frame(req);
+  for(unsigned attempt = 1; ; attempt++) {
+    write(packet);
+
+    string reply;
+    try {
+      reply = read(1, 1);
+      if(reply == ".") {
+        reply += read(length + 2, timeout);
+        if(crc16(reply) == 0) {
+          _stats->command(req[0], start);
+          return reply.substr(1, length);
+        }
+      }
+    } catch(io_error& e) {
+      // lost bytes; resynchronize below
+    }
+
+    // the device may have acted on a request whose reply was lost, and
+    // a baud rate switch cannot be simply repeated
+    if(attempt == RETRIES || (req[0] == 'u' && reply != "N"))
+      throw io_error("no valid reply after retransmissions");
+
+    _stats->retransmitted(1);
+    if(reply != "N")
+      resync();
+  }
+}
+
+string vuxboot::frame(string req) {
+  unsigned crc = crc16(req);
+  req += char(crc & 0xff);
+  req += char(crc >> 8);
+  return req;
+}
+
+unsigned vuxboot::max_items(unsigned unit) {
+  unsigned items = (_framed ? 256 : 16384) / unit;
+  return items > 0 ? items : 1;
+}
+
+unsigned vuxboot::page_packet_bytes() {
+  return _page_words * 2 + (_framed ? 6 : 4);
+}
+
+void vuxboot::resync() {
+  settle();
+
+  // a `z' packet of single-word literal runs is the longest one
+  write(string(_page_words * 3 + 8, 0));
+  settle();
+}
+
+void vuxboot::settle() {
+  drain();
+
+  long long deadline = monotonic_us() + 5000000;
+  while(true) {
+    _input.clear();
+    if(monotonic_us() > deadline)
+      throw io_error("line does not settle");
+
+    try {
+      poll(monotonic_us() + 100000);
+    } catch(io_error& e) {
+      if(_input.empty())
+        return;
+    }
+  }
+}
+
+void vuxboot::poll(long long deadline) {
+  unsigned events = EPOLLIN | (_output.empty() ? 0 : EPOLLOUT);
+  if(events != _events) {
+    epoll_event ev = {0};
+    ev.events = events;
+    ev.data.fd = _fd;
+    if(epoll_ctl(_epoll, EPOLL_CTL_MOD, _fd, &ev) == -1)
+      throw io_error("cannot epoll_ctl()");
+    _events = events;
+  }
+
+  long long timeout = (deadline - monotonic_us() + 999) / 1000;
+  if(timeout <= 0)
+    throw io_error(_output.empty() ? "read timeout" : "write timeout");
+
+  epoll_event ev;
+  int retval = epoll_wait(_epoll, &ev, 1, timeout);
+  if(retval == -1) {
+    if(errno == EINTR)
+      return;
+    throw io_error("cannot epoll_wait()");
+  } else if(retval == 0) {
+    throw io_error(_output.empty() ? "read timeout" : "write timeout");
+  } else if(ev.events & (EPOLLERR | EPOLLHUP)) {
+    throw io_error("i/o error");
+  }
+
+  if(ev.events & EPOLLIN)
+    receive();
+  if(ev.events & EPOLLOUT)
+    transmit();
+}
+
+void vuxboot::receive() {
+  char data[4096];
+  while(true) {
+    int retval = ::read(_fd, data, sizeof(data));
+    if(retval == -1) {
+      if(errno == EAGAIN || errno == EINTR)
+        return;
+      throw io_error("cannot read()");
+    } else if(retval == 0) {
+      throw io_error("read() == 0");
+    }
+
+    _input.append(data, retval);
+    _stats->received(retval);
+    if(_trace)
+      _trace->add(trace::RECEIVED, monotonic_us(), data, retval);
+  }
+}
+
+void vuxboot::transmit() {
+  while(!_output.empty()) {
+    int retval = ::write(_fd, _output.data(), _output.length());
+    if(retval == -1) {
+      if(errno == EAGAIN || errno == EINTR)
+        return;
+      throw io_error("cannot write()");
+    }
+
+    if(_trace)
+      _trace->add(trace::SENT, monotonic_us(), _output.data(), retval);
+    _output.erase(0, retval);
+    _stats->sent(retval);
+  }
+}
+
+void vuxboot::wait_flash(unsigned count) {
+  unsigned attempt = 1;
+  while(count > 0) {
+    string status;
+    try {
+      if(!_framed) {
+        status = read(2);
+        if(status[0] != '.')
+          throw hardware_error("cannot write flash");
+      } else if(!read_framed_ack(status)) {
+        if(attempt++ == RETRIES)
+          throw io_error("no valid reply after retransmissions");
+
+        // A refused page is sent again on its own; otherwise packet
+        // boundaries may be lost, and every page in flight is.
+        if(status == "N") {
+          _sent.push_back(_sent.front());
+          _sent.pop_front();
+          write(_sent.back().data);
+          _stats->retransmitted(1);
+        } else {
+          resync();
+          for(unsigned i = 0; i < _sent.size(); i++)
+            write(_sent[i].data);
+          _stats->retransmitted(_sent.size());
+        }
+        continue;
+      }
+
+      if(byte(status[1]) != byte(_sent.front().sequence))
+        throw protocol_error("flash write acknowledged out of order");
+    } catch(error& e) {
+      if(_listener && !_sent.empty())
+        _listener->page_failed(_sent.front().page, e);
+      throw;
+    }
+
+    count--;
+    _pending--;
+    _in_flight -= _sent.front().data.length();
+    _stats->command(_sent.front().data[0], _sent.front().time);
+    if(_listener)
+      _listener->page_written(_sent.front().page);
+    if(_batch_total)
+      notify("flash_write", ++_batch_done, _batch_total);
+    _sent.pop_front();
+  }
+}
+
+bool vuxboot::read_framed_ack(string& status) {
+  try {
+    status = read(1, 1);
+    if(status != ".")
+      return false;
+
+    status = read(4);
+    return crc16("." + status) == 0;
+  } catch(io_error& e) {
+    status = "";
+    return false;
+  }
+}
+
+string vuxboot::rle_encode(const char* words, unsigned count) {
+  string packed;
+
+  unsigned literal = 0; // position of control byte of current literal run
+  bool in_literal = false;
+  for(unsigned i = 0; i < count; ) {
+    unsigned repeat = 1;
+    while(i + repeat < count && repeat < 128 &&
+          memcmp(words + i * 2, words + (i + repeat) * 2, 2) == 0)
+      repeat++;
+
+    if(repeat >= 2) {
+      packed += char(0x7f + repeat);
+      packed.append(words + i * 2, 2);
+      in_literal = false;
+      i += repeat;
+    } else {
+      if(!in_literal || byte(packed[literal]) == 0x7f) {
+        literal = packed.length();
+        packed += char(0xff); // incremented to 0 below
+        in_literal = true;
+      }
+      packed[literal]++;
+      packed.append(words + i * 2, 2);
+      i++;
+    }
+  }
+
+  return packed;
+}
+
+void vuxboot::notify(string operation, unsigned done, unsigned total) {
+  if(_listener)
+    _listener->progress(operation, done, total);
+}
+
+const char* vuxboot::SIGNATURE = "VuX";
+
+void read_pages(vuxboot& bl, const vector<unsigned>& pages, memory_image& into) {
+  for(unsigned i = 0; i < pages.size(); ) {
+    unsigned run = 1;
+    while(i + run < pages.size() && pages[i + run] == pages[i] + run)
+      run++;
+
+    bl.read_flash_range(pages[i], run, into);
+    i += run;
+  }
+}
+
+vector<unsigned> page_crcs(vuxboot& bl, const vector<unsigned>& pages) {
+  vector<unsigned> result;
+
+  if(bl.has_feature(vuxboot::FEATURE_CRC)) {
+    for(unsigned i = 0; i < pages.size(); ) {
+      unsigned run = 1;
+      while(i + run < pages.size() && pages[i + run] == pages[i] + run)
+        run++;
+
+      vector<unsigned> crcs = bl.crc_flash_range(pages[i], run);
+      result.insert(result.end(), crcs.begin(), crcs.end());
+
+      i += run;
+    }
+  } else {
+    memory_image data(bl.page_words() * 2);
+    read_pages(bl, pages, data);
+    for(unsigned i = 0; i < pages.size(); i++)
+      result.push_back(crc32(data.page(pages[i]), data.page_bytes()));
+  }
+
+  return result;
+}
+
+vector<unsigned> diff_pages(vuxboot& bl, const memory_image& image,
+      const vector<unsigned>& pages) {
+  vector<unsigned> result;
+
+  if(bl.has_feature(vuxboot::FEATURE_CRC)) {
+    vector<unsigned> crcs = page_crcs(bl, pages);
+    for(unsigned i = 0; i < pages.size(); i++) {
+      if(crcs[i] != crc32(image.page(pages[i]), image.page_bytes()))
+        result.push_back(pages[i]);
+    }
+  } else {
+    memory_image data(image.page_bytes());
+    read_pages(bl, pages, data);
+    for(unsigned i = 0; i < pages.size(); i++) {
+      if(!image.same(pages[i], data.page(pages[i])))
+        result.push_back(pages[i]);
+    }
+  }
+
+  return result;
+}
+
+// Maps a whole file into memory. Files which cannot be mapped, such as
+// pipes, are read instead.
+class mapped_file {
+public:
+  mapped_file(string filename) : _data(NULL), _length(0), _mapped(false) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd == -1)
+      throw io_error("cannot read from data file");
+
+    struct stat info;
+    if(fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+      void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(data != MAP_FAILED) {
+        _data = (const char*) data;
+        _length = info.st_size;
+        _mapped = true;
+      }
+    }
+
+    if(!_mapped) {
+      char buffer[65536];
+      int retval;
+      while((retval = ::read(fd, buffer, sizeof(buffer))) != 0) {
+        if(retval == -1) {
+          if(errno == EINTR)
+            continue;
+          close(fd);
+          throw io_error("cannot read from data file");
+        }
+        _buffer.append(buffer, retval);
+      }
+      _data = _buffer.data();
+      _length = _buffer.length();
+    }
+
+    close(fd);
+  }
+
+  ~mapped_file() {
+    if(_mapped)
+      munmap((void*) _data, _length);
+  }
+
+  const char* data() {
+    return _data;
+  }
+
+  size_t length() {
+    return _length;
+  }
+
+private:
+  mapped_file(const mapped_file&);
+  mapped_file& operator=(const mapped_file&);
+
+  const char* _data;
+  size_t _length;
+  bool _mapped;
+  string _buffer;
+};
+
+// Values of hex digits; -1 for other characters.
+struct hex_table {
+  hex_table() {
+    for(int i = 0; i < 256; i++)
+      value[i] = -1;
+    for(int i = 0; i < 10; i++)
+      value['0' + i] = i;
+    for(int i = 0; i < 6; i++)
+      value['a' + i] = value['A' + i] = 10 + i;
+  }
+
+  signed char value[256];
+};
+
+static const hex_table hex_digits;
+
+// Decodes Intel HEX, including extended segment (02) and linear (04)
+// addresses.
+static memory_image read_ihex(string filename) {
+  mapped_file file(filename);
+  const byte *pos = (const byte*) file.data(), *end = pos + file.length();
+
+  memory_image image;
+  unsigned base = 0;
+
+  while(pos < end) {
+    if(*pos == '\r' || *pos == '\n') {
+      pos++;
+      continue;
+    }
+
+    if(*pos++ != ':')
+      throw input_error("invalid ihex data (format)");
+
+    byte record[5 + 255];
+    unsigned length = 0;
+    while(pos < end && *pos != '\r' && *pos != '\n') {
+      if(pos + 1 == end || length == sizeof(record))
+        throw input_error("invalid ihex data (format)");
+
+      int high = hex_digits.value[pos[0]], low = hex_digits.value[pos[1]];
+      if(high < 0 || low < 0)
+        throw input_error("invalid ihex data (format)");
+
+      record[length++] = (high << 4) | low;
+      pos += 2;
+    }
+
+    if(length < 5)
+      throw input_error("invalid ihex data (format)");
+    if(length != record[0] + 5)
+      throw input_error("invalid ihex data (payload size)");
+
+    byte checksum = 0;
+    for(unsigned i = 0; i < length; i++)
+      checksum += record[i];
+    if(checksum != 0)
+      throw input_error("invalid ihex data (checksum)");
+
+    byte ihex_len = record[0];
+    word ihex_addr = (record[1] << 8) + record[2];
+    byte ihex_type = record[3];
+    const byte* ihex_data = record + 4;
+
+    if(ihex_type == 0) { // data
+      // extended addresses reach up to 4 GiB, far beyond any device
+      if((unsigned long long) base + ihex_addr + ihex_len > memory_image::MAX_BYTES)
+        throw input_error("invalid ihex data (address beyond 16 MiB)");
+      image.write(base + ihex_addr, (const char*) ihex_data, ihex_len);
+    } else if(ihex_type == 1) { // eof
+      return image;
+    } else if(ihex_type == 2 || ihex_type == 4) { // segment or upper address
+      if(ihex_len != 2)
+        throw input_error("invalid ihex data (invalid extended address)");
+
+      base = (ihex_data[0] << 8) + ihex_data[1];
+      base <<= ihex_type == 2 ? 4 : 16;
+    } else if(ihex_type == 3 || ihex_type == 5) { // start address
+      if(ihex_len != 4)
+        throw input_error("invalid ihex data (invalid start address)");
+
+      // ignore start address
+    } else {
+      throw input_error("invalid ihex data (type)");
+    }
+  }
+
+  throw input_error("invalid ihex data (unterminated file)");
+}
+
+// Loads an AVR ELF file, such as avr-gcc output, directly. Loadable
+// segments are placed by their physical address: flash is at 0, and
+// eeprom at 0x810000.
+static memory_image read_elf(string filename, storage::memory memory) {
+  static const unsigned EEPROM_BASE = 0x810000, EEPROM_END = 0x820000,
+        DATA_BASE = 0x800000;
+
+  mapped_file file(filename);
+  const char* data = file.data();
+
+  Elf32_Ehdr header;
+  if(file.length() < sizeof(header))
+    throw input_error("invalid elf data (header)");
+  memcpy(&header, data, sizeof(header));
+
+  if(memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 ||
+        header.e_ident[EI_CLASS] != ELFCLASS32 || header.e_ident[EI_DATA] != ELFDATA2LSB)
+    throw input_error("invalid elf data (not a 32-bit little-endian ELF file)");
+  if(header.e_machine != EM_AVR)
+    throw input_error("invalid elf data (not an AVR executable)");
+  if(header.e_phentsize != sizeof(Elf32_Phdr) ||
+        header.e_phoff + (unsigned long long) header.e_phnum * sizeof(Elf32_Phdr) > file.length())
+    throw input_error("invalid elf data (program headers)");
+
+  memory_image image;
+  for(unsigned i = 0; i < header.e_phnum; i++) {
+    Elf32_Phdr segment;
+    memcpy(&segment, data + header.e_phoff + i * sizeof(segment), sizeof(segment));
+
+    if(segment.p_type != PT_LOAD || segment.p_filesz == 0)
+      continue;
+    if((unsigned long long) segment.p_offset + segment.p_filesz > file.length())
+      throw input_error("invalid elf data (segment outside of file)");
+
+    unsigned addr = segment.p_paddr;
+    if(memory == storage::flash && addr < DATA_BASE) {
+      // flash addresses as they are
+    } else if(memory == storage::eeprom && addr >= EEPROM_BASE && addr < EEPROM_END) {
+      addr -= EEPROM_BASE;
+    } else {
+      continue;
+    }
+
+    image.write(addr, data + segment.p_offset, segment.p_filesz);
+  }
+
+  return image;
+}
+
+memory_image read_file(string filename, storage::format format,
+      storage::memory memory) {
+  if(format == storage::ihex)
+    return read_ihex(filename);
+  else if(format == storage::elf)
+    return read_elf(filename, memory);
+
+  mapped_file file(filename);
+  return memory_image(file.data(), file.length());
+}
+
+// Appends an ihex record to `text'.
+static void put_ihex_record(string& text, byte type, unsigned addr, const char* data, unsigned length) {
+  static const char digits[] = "0123456789ABCDEF";
+
+  byte header[4] = { byte(length), byte(addr >> 8), byte(addr), type };
+  byte checksum = 0;
+
+  text += ':';
+  for(unsigned i = 0; i < 4 + length; i++) {
+    byte value = i < 4 ? header[i] : byte(data[i - 4]);
+    text += digits[value >> 4];
+    text += digits[value & 0xf];
+    checksum += value;
+  }
+
+  checksum = -checksum;
+  text += digits[checksum >> 4];
+  text += digits[checksum & 0xf];
+  text += '\n';
+}
+
+string ihex_encode(const memory_image& data, unsigned base, unsigned record_bytes) {
+  string text;
+  text.reserve(data.length() * 2 + data.length() / record_bytes * 12 + 16);
+
+  unsigned upper = 0;
+  for(unsigned i = 0; i < data.length(); ) {
+    unsigned addr = base + i;
+    unsigned length = min(record_bytes, (unsigned) data.length() - i);
+
+    // records may not cross a 64 KiB boundary
+    if((addr & 0xffff) + length > 0x10000)
+      length = 0x10000 - (addr & 0xffff);
+
+    if(memory_image::blank_bytes(data.data() + i, length)) {
+      i += length;
+      continue;
+    }
+
+    if(addr >> 16 != upper) {
+      upper = addr >> 16;
+      char address[2] = { char(upper >> 8), char(upper) };
+      put_ihex_record(text, 4, 0, address, 2);
+    }
+
+    put_ihex_record(text, 0, addr, data.data() + i, length);
+    i += length;
+  }
+
+  put_ihex_record(text, 1, 0, NULL, 0);
+  return text;
+}
+
+void write_file(string filename, storage::format format, const memory_image& data,
+      unsigned base, unsigned record_bytes) {
+  ios::openmode flags = ios::out;
+  if(format == storage::binary)
+    flags |= ios::binary;
+
+  ofstream out(filename.c_str(), flags);
+  if(!out)
+    throw io_error("cannot write to data file");
+
+  if(format == storage::binary) {
+    out.write(data.data(), data.length());
+  } else if(format == storage::ihex) {
+    string text = ihex_encode(data, base, record_bytes);
+    out.write(text.data(), text.length());
+  } else {
+    throw input_error("cannot write this format");
+  }
+
+  if(!out.flush())
+    throw io_error("cannot write to data file");
+}
+
+}
@@ -0,0 +1,488 @@
+/*
+ * Copyright (c) 2010 Peter Zotov <whitequark@whitequark.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _VUXBOOT_H_
+#define _VUXBOOT_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <iostream>
+#include <exception>
+
+#include <termios.h>
+
+// The host side of the VuXboot protocol, as a library: a device session,
+// image codecs and page comparison. See PROTOCOL for the wire format.
+//
+// Nothing here prints; failures are thrown as `error' (by value), and
+// long operations are reported to a vuxboot_listener. All names are in
+// namespace vux, as is the trace of trace.h.
+
+// bumped whenever this header changes incompatibly
+#define VUXBOOT_API_VERSION 2
+
+namespace vux {
+
+class trace;
+
+namespace storage {
+  enum format {
+    ihex,
+    binary,
+    elf
+  };
+
+  enum memory {
+    flash,
+    eeprom
+  };
+}
+
+// Base of all errors thrown by the library. Each kind has a class of its
+// own, so they can be caught separately or together with kind() telling
+// them apart.
+class error: public std::exception {
+public:
+  enum kind_type {
+    INTERNAL,
+    IO,
+    FEATURE,
+    HARDWARE,
+    INPUT,
+    PROTOCOL
+  };
+
+  error(std::string message, kind_type kind = INTERNAL);
+  ~error() throw();
+
+  std::string message() const;
+  kind_type kind() const;
+  const char* what() const throw();
+
+private:
+  std::string _message;
+  kind_type _kind;
+};
+
+// the port failed, or the device did not answer in time
+class io_error: public error {
+public:
+  io_error(std::string message);
+};
+
+// the device lacks what was asked of it
+class feature_error: public error {
+public:
+  feature_error(std::string message);
+};
+
+// the device reported a failure
+class hardware_error: public error {
+public:
+  hardware_error(std::string message);
+};
+
+// an image file is unreadable or does not fit the device
+class input_error: public error {
+public:
+  input_error(std::string message);
+};
+
+// the device answered something unexpected
+class protocol_error: public error {
+public:
+  protocol_error(std::string info, std::string node = "");
+};
+
+// CRC-32 as computed by the `c' command.
+unsigned crc32(const char* data, unsigned length);
+unsigned crc32(std::string data);
+
+// CRC-16 which ends packets in framed mode.
+unsigned crc16(std::string data);
+
+// Time in microseconds from an arbitrary point, which never goes back.
+long long monotonic_us();
+
+// Quotes `text' as a JSON string.
+std::string json_string(std::string text);
+
+// Contents of flash or eeprom. Storage is contiguous and page-aligned,
+// and unwritten space is blank (0xff). For every page it is tracked
+// whether anything was written to it (present), whether it is all 0xff
+// (blank) and whether it was written since the last clean() (dirty).
+class memory_image {
+public:
+  // Largest image; no AVR has nearly as much memory. Data beyond it is
+  // rejected with input_error.
+  static const unsigned MAX_BYTES = 16 << 20;
+
+  memory_image(unsigned page_bytes = 16);
+  memory_image(const char* data, unsigned length, unsigned page_bytes = 16);
+
+  unsigned page_bytes() const;
+  // Number of bytes up to the end of data.
+  unsigned length() const;
+  unsigned pages() const;
+
+  const char* data() const;
+  const char* page(unsigned index) const;
+
+  bool present(unsigned index) const;
+  bool blank(unsigned index) const;
+  bool dirty(unsigned index) const;
+  void clean();
+
+  bool same(unsigned index, const char* data) const;
+  std::string bytes(unsigned addr, unsigned length) const;
+
+  void write(unsigned addr, const char* data, unsigned length);
+
+  // Grows the image with blank space up to `length' bytes.
+  void extend(unsigned length);
+
+  // Regroups the image into pages of another size; a page is present or
+  // dirty if any of its parts was.
+  void repage(unsigned page_bytes);
+
+  // Checks for 0xff a machine word at a time.
+  static bool blank_bytes(const char* data, unsigned length);
+
+private:
+  unsigned _page_bytes, _length;
+  std::vector<char> _data;
+  std::vector<bool> _present, _blank, _dirty;
+};
+
+// Performance counters of a session. They are printed as JSON at the end
+// of the run, and phases can also be streamed as they finish, one JSON
+// object per line.
+class stats {
+public:
+  stats(std::string tag = "", std::ostream* stream = NULL);
+
+  void sent(unsigned bytes);
+  void received(unsigned bytes);
+  void pages_read(unsigned count);
+  void pages_written(unsigned count);
+  void pages_skipped(unsigned count);
+  void retransmitted(unsigned count);
+
+  unsigned long long bytes();
+  unsigned pages();
+  unsigned requests();
+
+  void command(char command, long long start);
+  void phase(std::string name, long long start);
+
+  // Finishes the session; returns the summary as a JSON object.
+  std::string finish(bool success);
+
+  void describe_latency(std::ostream& out);
+
+private:
+  // upper limits of histogram buckets, in microseconds
+  static const int BUCKETS = 14;
+  static const long long BUCKET_LIMITS[BUCKETS - 1];
+
+  struct latency {
+    latency() : count(0), total(0), min(0), max(0) {
+      for(int i = 0; i < BUCKETS; i++)
+        histogram[i] = 0;
+    }
+
+    unsigned count;
+    long long total, min, max;
+    unsigned histogram[BUCKETS];
+  };
+
+  void emit(std::string line);
+
+  std::string _tag;
+  std::ostream* _stream;
+
+  long long _start;
+  unsigned _sent, _received;
+  unsigned _pages_read, _pages_written, _pages_skipped, _retransmits;
+
+  std::map<char, latency> _latency;
+  std::map<std::string, long long> _phases;
+  std::vector<std::string> _phase_order;
+};
+
+// Receives events of a session. Methods are called from inside vuxboot
+// calls, on their thread; they must not call back into the session.
+class vuxboot_listener {
+public:
+  virtual ~vuxboot_listener() {}
+
+  // A queued page was acknowledged by the device.
+  virtual void page_written(unsigned page) {}
+
+  // A queued page was not written; `e' is thrown right after.
+  virtual void page_failed(unsigned page, const error& e) {}
+
+  // `done' of `total' units (pages or bytes) of `operation' are finished:
+  // "flash_read", "flash_crc", "flash_write", "flash_erase",
+  // "eeprom_read" or "eeprom_write".
+  virtual void progress(std::string operation, unsigned done, unsigned total) {}
+};
+
+class vuxboot {
+  static const char* SIGNATURE;
+
+public:
+  enum feature {
+    FEATURE_PIPELINE = 1 << 0,
+    FEATURE_BULK_READ = 1 << 1,
+    FEATURE_CRC = 1 << 2,
+    FEATURE_EEPROM_BLOCK = 1 << 3,
+    FEATURE_EEPROM_RANGE = 1 << 4,
+    FEATURE_BAUD = 1 << 5,
+    FEATURE_RLE = 1 << 6,
+    FEATURE_ERASE = 1 << 7,
+    FEATURE_FRAMED = 1 << 8
+  };
+
+  // attempts at a framed request before giving up
+  static const unsigned RETRIES = 8;
+
+  vuxboot(std::string filename, unsigned baud = B115200, stats* st = NULL);
+  ~vuxboot();
+
+  bool get_debug();
+  void set_debug(bool new_debug);
+  void set_trace(trace* new_trace);
+
+  // Counts traffic into `st' from now on, or into statistics of the
+  // session's own if it is NULL.
+  void set_statistics(stats* st);
+
+  // Events are sent to `new_listener', or nowhere if it is NULL.
+  void set_listener(vuxboot_listener* new_listener);
+
+  void identify();
+
+  // Turns framed mode on or off. In framed mode, requests and replies
+  // carry a CRC, and damaged ones are sent again.
+  void set_framed(bool framed);
+  bool framed();
+
+  void describe(std::ostream& out = std::cout);
+
+  std::string read_flash(unsigned page);
+
+  // Reads `count' consecutive pages into an image with pages of the same
+  // size, with a single request if the device supports it, avoiding
+  // a turnaround per page.
+  void read_flash_range(unsigned first, unsigned count, memory_image& into);
+
+  // Returns CRC-32 of each page in range, computed on the device.
+  std::vector<unsigned> crc_flash_range(unsigned first, unsigned count);
+
+  // Writes a page of `page_words() * 2' bytes.
+  void write_flash(unsigned page, const char* words);
+
+  // Sends a page without waiting for it to be written. Up to flash_window()
+  // pages are kept in flight; call flush_flash() to wait for the rest.
+  // Pages are run-length encoded if the device can decode them and it
+  // makes them shorter; more of such pages fit in the window.
+  void queue_flash(unsigned page, const char* words);
+  void flush_flash();
+
+  // Queues the given pages of an image with pages of device size, and
+  // waits for all of them to be written.
+  void write_pages(const memory_image& image, const std::vector<unsigned>& pages);
+
+  // Blanks a range of pages. Devices which cannot erase pages alone
+  // are sent pages of 0xff.
+  void erase_flash(unsigned first, unsigned count);
+
+  std::string read_eeprom();
+  std::string read_eeprom(unsigned address, unsigned length);
+  void write_eeprom(unsigned address, unsigned char b);
+
+  // Writes a run of bytes, split into packets which fit in the device
+  // receive ring. Falls back to byte-by-byte writes on older devices.
+  void write_eeprom_block(unsigned address, std::string data);
+
+  // Asks the device to switch to `rate' and follows it; 0 selects the
+  // rate used to connect. If the new rate does not work, both ends return
+  // to the initial one and false is returned.
+  bool switch_baud(unsigned rate);
+
+  void reset();
+
+  // Checks cheaply whether the device answers `v' at the current rate.
+  // The device must not be in framed mode.
+  bool ping();
+
+  bool has_eeprom();
+  unsigned eeprom_bytes();
+  unsigned flash_pages();
+  unsigned boot_pages();
+  unsigned page_words();
+
+  // Device geometry, in a form usable as a file name.
+  std::string identity();
+
+  unsigned baud();
+  bool low_latency();
+
+  void describe_latency(std::ostream& out = std::cout);
+  stats& statistics();
+
+  bool has_feature(feature f);
+
+  // Number of `p' packets which fit in the device receive ring at once.
+  unsigned flash_window();
+
+  // Fails if no byte arrives for `timeout' seconds.
+  std::string read(unsigned length, unsigned timeout=5);
+
+  // Queues data for sending. Whatever the port does not accept at once
+  // is sent while waiting for input, or at latest by drain().
+  void write(std::string data);
+
+  void drain(unsigned timeout=5);
+
+private:
+  void read_features();
+
+  // Sets the port to `rate', or to the initial rate if it is 0.
+  bool set_baud(unsigned rate);
+
+  // Finds UBRR and U2X values for `rate'. Returns the rate they give, or
+  // 0 if it is off by more than 2%, as the AVR USART would not sync then.
+  unsigned baud_divisor(unsigned rate, unsigned& ubrr, bool& u2x);
+
+  // Sends a command and waits for its reply, recording the round trip.
+  // In framed mode, the request is sent again if the device refuses it
+  // or its reply is damaged; see PROTOCOL.
+  std::string request(std::string req, unsigned length, unsigned timeout=5);
+
+  // Appends the CRC which ends framed requests.
+  static std::string frame(std::string req);
+
+  // Largest number of `unit'-byte items to request at once. Framed replies
+  // are kept short, so that a damaged one is cheap to send again; others
+  // are kept to 16 KiB, which take under 1.5 s at 115200 baud.
+  unsigned max_items(unsigned unit);
+
+  // Longest `p' packet, as counted against the device receive ring.
+  unsigned page_packet_bytes();
+
+  // Brings the device back to packet boundaries after bytes were lost or
+  // damaged: once the line is quiet, zeros complete any partial request,
+  // which then fails its CRC, and are answered with `E' otherwise.
+  void resync();
+
+  // Discards input until the device has been silent for a while.
+  void settle();
+
+  // Waits until the port is ready or `deadline' (in microseconds) passes, then moves
+  // received bytes to the input buffer and pending output to the port.
+  void poll(long long deadline);
+  void receive();
+  void transmit();
+
+  void wait_flash(unsigned count);
+
+  // Reads the acknowledgement of a framed `p' or `z' packet into `status',
+  // returning whether it is intact. A refusal leaves "N" there.
+  bool read_framed_ack(std::string& status);
+
+  // Encodes a page for `z': a control byte N < 0x80 is followed by N+1
+  // words, N >= 0x80 by one word repeated N-0x7f times.
+  static std::string rle_encode(const char* words, unsigned count);
+
+  // Passes progress to the listener, if any.
+  void notify(std::string operation, unsigned done, unsigned total);
+
+  // a pipelined page, kept until acknowledged
+  struct packet {
+    std::string data;
+    unsigned page;
+    char sequence;
+    long long time;
+  };
+
+  bool _debug;
+  bool _low_latency, _was_low_latency;
+  stats _own_stats, *_stats;
+  trace* _trace;
+  vuxboot_listener* _listener;
+  std::deque<packet> _sent;
+
+  int _fd, _epoll;
+  unsigned _events;
+  termios _termios, _settings;
+  std::string _input, _output;
+  unsigned _baud;
+
+  bool _has_eeprom;
+  unsigned _eeprom_bytes;
+  unsigned _page_words, _flash_pages, _boot_pages;
+
+  unsigned _features, _ring_bytes, _f_cpu;
+  bool _framed;
+  unsigned char _sequence;
+  unsigned _pending, _in_flight;
+  // pages of the current write_pages() call, for progress
+  unsigned _batch_done, _batch_total;
+};
+
+// Reads the given pages, which must be sorted, into an image with pages
+// of device size, coalescing runs of consecutive pages into single range
+// requests.
+void read_pages(vuxboot& bl, const std::vector<unsigned>& pages, memory_image& into);
+
+// Returns CRC-32 of the given (sorted) pages, computed on the device if
+// it is able to, or locally from a readback otherwise.
+std::vector<unsigned> page_crcs(vuxboot& bl, const std::vector<unsigned>& pages);
+
+// Returns those of the given (sorted) pages whose contents on the device
+// differ from the image, which has pages of device size. Devices with
+// on-chip checksums are compared by CRC, so that no page data has to be
+// transferred.
+std::vector<unsigned> diff_pages(vuxboot& bl, const memory_image& image,
+      const std::vector<unsigned>& pages);
+
+// Reads the contents of `memory' from a file. Only ELF files hold
+// flash and eeprom at once; other formats hold whichever is written.
+memory_image read_file(std::string filename, storage::format format,
+      storage::memory memory = storage::flash);
+
+// Encodes `data' placed at `base' as Intel HEX, in records of up to
+// `record_bytes'. Blank (0xff) records are omitted, and addresses above
+// 64 KiB are set with extended linear address records.
+std::string ihex_encode(const memory_image& data, unsigned base, unsigned record_bytes);
+
+void write_file(std::string filename, storage::format format, const memory_image& data,
+      unsigned base = 0, unsigned record_bytes = 16);
+
+}
+
+#endif
@@ -22,20 +22,39 @@
  */
 
 #include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <iterator>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <new>
 #include <cctype>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
 #include "picoopt.h"
+#include "serial.h"
+#include "trace.h"
+#include "vuxboot.h"
 
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/select.h>
-#include <sys/ioctl.h>
-#include <linux/serial.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <glob.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <termios.h>
 
 using namespace std;
+using namespace vux;
 
 typedef unsigned char byte;
 typedef unsigned short word;
@@ -54,454 +73,1351 @@ const char* usage[] = {
   "    eeprom_read|er <filename>",
   "    eeprom_write|ew <filename>",
   "    reset|r",
+  "    bench [runs]",
+  "      Measure a standard workload: identify, flash dump, full and sparse",
+  "      flash write, eeprom dump and rewrite; 5 runs by default. Flash",
+  "      and eeprom contents are destroyed.",
+  "    trace <filename>",
+  "      Print a protocol trace recorded with -T option.",
+  "    replay <filename>",
+  "      Act as the device of a trace on a pseudo-terminal, checking that",
+  "      vuxprog sends exactly what it did when the trace was recorded.",
+  "    script <filename>",
+  "      Run the actions listed in a file, or standard input if it is -,",
+  "      in a single session: one per line, with its argument and the -f,",
+  "      -F, -a, -o, -l and -R options. Options of the command line apply",
+  "      to every line. A `reset' line resets the device once all are done.",
+  "    daemon <socket>",
+  "      Keep the devices at -s PORTS open and identified, and run the",
+  "      actions of `vuxprog -D <socket>' on them one at a time, without",
+  "      connecting again. A device is closed after a reset or a failure.",
   "",
   "  Options:",
-  "    -s PORT\tset serial port device; default is /dev/ttyUSB0",
-  "    -f FORMAT\tset file format; FORMAT may be ihex (default) or binary",
+  "    -s PORTS\tset serial port device; default is /dev/ttyUSB0",
+  "    \t\tPORTS may be a comma-separated list and contain wildcards;",
+  "    \t\tall matching devices are programmed in parallel, and dumps",
+  "    \t\tare written to <filename>.<port>",
+  "    -f FORMAT\tset file format; FORMAT may be ihex (default) or binary;",
+  "    \t\twrite actions also accept elf, taking flash or eeprom contents",
+  "    \t\tfrom loadable segments",
+  "    -R BYTES\twrite ihex records of BYTES; 16 (default), 32 or 64",
   "    -i SEQ\tstart bootloader by sending SEQ to port",
+  "    -C\t\tend packets with a CRC and send damaged ones again, if",
+  "    \t\tthe device can do it; slower, but survives a noisy line",
+  "    -b BAUD\tswitch to BAUD after connecting at 115200, if the device",
+  "    \t\tcan do it; stay at 115200 otherwise",
   "    -r\t\treset device after successful programming",
   "    -a\t\tdump full flash including bootloader code",
+  "    -c DIR\tremember flash contents of devices in DIR, so that unchanged",
+  "    \t\tpages need not be read back on next flash_write",
+  "    -n ADDR:LEN\ttell devices apart by serial number stored in eeprom",
+  "    \t\tat ADDR; without it, all devices of a type share the cache,",
+  "    \t\tso -c needs it in parallel mode",
+  "    -k FILE\tjournal flash_write progress to FILE, so that an interrupted",
+  "    \t\tsession is resumed at the first page not yet written; in",
+  "    \t\tparallel mode, to FILE.<port>",
+  "    -o OFFSET\tread or write eeprom starting at OFFSET; the rest of",
+  "    \t\teeprom is left untouched, and the file's first byte is the",
+  "    \t\tone at OFFSET",
+  "    -l LEN\tread LEN bytes of eeprom",
+  "    -t\t\treport round-trip time of each command",
+  "    -T FILE\trecord raw protocol traffic to FILE; in parallel mode,",
+  "    \t\tto FILE.<port>",
+  "    -j FILE\twrite statistics of all sessions to FILE as JSON",
+  "    -J FILE\tstream statistics to FILE as they are collected, one",
+  "    \t\tJSON object per line",
+  "    -D SOCKET\trun the action on the devices of a daemon listening",
+  "    \t\tat SOCKET; -s selects some of them",
   "    -d\t\toutput debug information",
   "    -F\t\tdo things which sane human wouldn't",
   ""
 };
 
-namespace storage {
-  enum format {
-    ihex,
-    binary
-  };
-}
-
-class error: public exception {
+// Last known flash contents of a device, as CRC-32 of each page. It is
+// kept between runs so that flash_write can plan without a readback.
+class flash_cache {
 public:
-  error(string message) : _message(message) {}
-  string message() { return _message; }
-  ~error() throw() { }
+  // `per_device' tells that the file belongs to a single device, rather
+  // than to all devices of a type.
+  flash_cache(string filename = "", bool per_device = false) :
+        _filename(filename), _per_device(per_device) {
+    if(_filename == "")
+      return;
+
+    ifstream in(_filename.c_str());
+    unsigned page, crc;
+    while(in >> dec >> page >> hex >> crc)
+      _crcs[page] = crc;
+  }
+
+  bool enabled() {
+    return _filename != "";
+  }
+
+  bool has(unsigned page) {
+    return _crcs.find(page) != _crcs.end();
+  }
+
+  unsigned get(unsigned page) {
+    return _crcs[page];
+  }
+
+  void set(unsigned page, unsigned crc) {
+    _crcs[page] = crc;
+  }
+
+  void forget(unsigned page) {
+    _crcs.erase(page);
+  }
+
+  // Returns up to `count' known pages, spread evenly.
+  vector<unsigned> sample(unsigned count) {
+    vector<unsigned> pages, result;
+    for(map<unsigned, unsigned>::iterator it = _crcs.begin(); it != _crcs.end(); ++it)
+      pages.push_back(it->first);
+
+    if(pages.size() <= count)
+      return pages;
+
+    for(unsigned i = 0; i < count; i++)
+      result.push_back(pages[i * pages.size() / count]);
+    return result;
+  }
+
+  // Checks known pages against the device; a mismatch means the device
+  // was programmed by someone else, or is another one of the same type,
+  // and the cache cannot be trusted. Devices with on-chip checksums have
+  // all pages checked at once. Others only have a sample read back, which
+  // cannot tell boards of a type apart, so a cache shared by all of them
+  // is not used there.
+  bool consistent(vuxboot& bl) {
+    vector<unsigned> pages;
+    if(bl.has_feature(vuxboot::FEATURE_CRC))
+      pages = sample(_crcs.size());
+    else if(_per_device)
+      pages = sample(4);
+    if(pages.empty())
+      return false;
+
+    vector<unsigned> crcs = page_crcs(bl, pages);
+    for(unsigned i = 0; i < pages.size(); i++) {
+      if(crcs[i] != get(pages[i]))
+        return false;
+    }
+    return true;
+  }
+
+  // The file is replaced atomically, so an interrupted run never leaves
+  // a cache which claims more than is known.
+  void save() {
+    if(_filename == "")
+      return;
+
+    string temp = _filename + ".tmp";
+    ofstream out(temp.c_str());
+    for(map<unsigned, unsigned>::iterator it = _crcs.begin(); it != _crcs.end(); ++it)
+      out << dec << it->first << ' ' << hex << setw(8) << setfill('0') << it->second << endl;
+    out.close();
+
+    if(!out || rename(temp.c_str(), _filename.c_str()) != 0)
+      throw io_error("cannot write to cache file");
+  }
 
 private:
-  string _message;
+  string _filename;
+  bool _per_device;
+  map<unsigned, unsigned> _crcs;
 };
 
-class io_error: public error {
+// Progress of a flash_write, kept so that an interrupted session can be
+// resumed. The header names the device and the image; every following
+// line is a page which was verified to hold its contents from the image.
+// Pages are appended and synced as they are verified, and a torn last
+// line is ignored on load.
+class flash_journal {
 public:
-  io_error(string message) : error(message) {}
-};
+  // pages verified at once
+  static const unsigned BATCH = 16;
 
-class feature_error: public error {
-public:
-  feature_error(string message) : error(message) {}
+  flash_journal(string filename = "", string device = "") :
+        _filename(filename), _device(device), _fd(-1) {}
+
+  ~flash_journal() {
+    if(_fd != -1)
+      close(_fd);
+  }
+
+  bool enabled() {
+    return _filename != "";
+  }
+
+  // Returns pages confirmed by an earlier session which wrote the same
+  // image to the same device.
+  vector<unsigned> load(unsigned image_crc) {
+    vector<unsigned> pages;
+    if(_filename == "")
+      return pages;
+
+    ifstream in(_filename.c_str());
+    string line;
+    if(!getline(in, line) || line != header(image_crc))
+      return pages;
+
+    while(getline(in, line) && !in.eof())
+      pages.push_back(strtoul(line.c_str(), NULL, 10));
+
+    sort(pages.begin(), pages.end());
+    pages.erase(unique(pages.begin(), pages.end()), pages.end());
+    return pages;
+  }
+
+  // Starts a journal holding `confirmed' pages, replacing the old one
+  // atomically.
+  void start(unsigned image_crc, const vector<unsigned>& confirmed) {
+    if(_filename == "")
+      return;
+
+    ostringstream text;
+    text << header(image_crc) << endl;
+    for(unsigned i = 0; i < confirmed.size(); i++)
+      text << confirmed[i] << endl;
+
+    string temp = _filename + ".tmp";
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(fd == -1 || !write_all(fd, text.str()) || fsync(fd) == -1 ||
+          rename(temp.c_str(), _filename.c_str()) != 0) {
+      if(fd != -1)
+        close(fd);
+      throw io_error("cannot write to journal file");
+    }
+
+    if(_fd != -1)
+      close(_fd);
+    _fd = fd;
+  }
+
+  // Records pages which were just verified.
+  void commit(const vector<unsigned>& pages) {
+    if(_fd == -1 || pages.empty())
+      return;
+
+    ostringstream text;
+    for(unsigned i = 0; i < pages.size(); i++)
+      text << pages[i] << endl;
+
+    if(!write_all(_fd, text.str()) || fsync(_fd) == -1)
+      throw io_error("cannot write to journal file");
+  }
+
+  // Forgets the journal once the image is fully written.
+  void finish() {
+    if(_fd == -1)
+      return;
+
+    close(_fd);
+    _fd = -1;
+    unlink(_filename.c_str());
+  }
+
+private:
+  // the descriptor is owned by exactly one journal
+  flash_journal(const flash_journal&);
+  flash_journal& operator=(const flash_journal&);
+
+  string header(unsigned image_crc) {
+    ostringstream text;
+    text << "vuxprog-journal 1 " << _device << " " << hex << setw(8) << setfill('0')
+         << image_crc;
+    return text.str();
+  }
+
+  static bool write_all(int fd, string data) {
+    for(unsigned done = 0; done < data.length(); ) {
+      ssize_t count = ::write(fd, data.data() + done, data.length() - done);
+      if(count == -1 && errno != EINTR)
+        return false;
+      if(count > 0)
+        done += count;
+    }
+    return true;
+  }
+
+  string _filename, _device;
+  int _fd;
 };
 
-class hardware_error: public error {
+// Returns those of the sorted `pages' which are not in sorted `excluded'.
+vector<unsigned> without(const vector<unsigned>& pages, const vector<unsigned>& excluded) {
+  vector<unsigned> result;
+  set_difference(pages.begin(), pages.end(), excluded.begin(), excluded.end(),
+        back_inserter(result));
+  return result;
+}
+
+// Devices which a daemon keeps open between jobs, identified and in the
+// bootloader. A session takes its device out and gives it back when it
+// is still usable.
+class device_pool {
 public:
-  hardware_error(string message) : error(message) {}
+  device_pool(vector<string> ports) : _ports(ports) {
+    pthread_mutex_init(&_lock, NULL);
+  }
+
+  ~device_pool() {
+    for(map<string, vuxboot*>::iterator it = _open.begin(); it != _open.end(); ++it)
+      delete it->second;
+    pthread_mutex_destroy(&_lock);
+  }
+
+  vector<string> ports() {
+    return _ports;
+  }
+
+  bool owns(string port) {
+    return find(_ports.begin(), _ports.end(), port) != _ports.end();
+  }
+
+  // Returns the open device at `port', or NULL if there is none.
+  vuxboot* take(string port) {
+    vuxboot* bl = NULL;
+    pthread_mutex_lock(&_lock);
+    map<string, vuxboot*>::iterator it = _open.find(port);
+    if(it != _open.end()) {
+      bl = it->second;
+      _open.erase(it);
+    }
+    pthread_mutex_unlock(&_lock);
+    return bl;
+  }
+
+  void give(string port, vuxboot* bl) {
+    pthread_mutex_lock(&_lock);
+    _open[port] = bl;
+    pthread_mutex_unlock(&_lock);
+  }
+
+private:
+  vector<string> _ports;
+  map<string, vuxboot*> _open;
+  pthread_mutex_t _lock;
 };
 
-class input_error: public error {
-public:
-  input_error(string message) : error(message) {}
+// Settings of a run, shared read-only by all device sessions.
+struct job {
+  string action, filename;
+  storage::format format;
+  unsigned record_bytes;
+  bool force, do_reset, dump_all, debug, timing, framed;
+  string init;
+  unsigned baud;
+
+  string cache_dir;
+  bool has_serial;
+  unsigned serial_addr, serial_len;
+
+  bool has_offset, has_length;
+  unsigned offset, length;
+
+  // input file of write actions, parsed once and shared by all devices
+  const memory_image* image;
+
+  unsigned runs;
+
+  // where line-delimited statistics go, if anywhere
+  ostream* stats_stream;
+
+  string trace_file;
+
+  // where flash_write keeps its progress, if anywhere
+  string journal_file;
+
+  // open devices of the daemon running the job, if any
+  device_pool* pool;
+
+  // actions of a script, run one after another in the same session
+  const vector<job>* steps;
 };
 
-class protocol_error: public error {
+// Progress output of a device session. When several sessions run at
+// once, output is emitted in whole lines tagged with the port, and
+// progress dots are omitted.
+class console: public vuxboot_listener {
 public:
-  protocol_error(string info, string node="") : error(make_message(info, node)) {}
-  ~protocol_error() throw() {}
+  console(string tag = "") : _tag(tag), _dots(false), _progress(true), _pages(0) {}
 
-private:
-  static string make_message(string info, string node) {
-    string message = info;
-    if(node != "")
-      message += ": `" + node + "'";
-    return message;
+  // Turns begin/step/end output off or on.
+  void set_progress(bool progress) {
+    _progress = progress;
   }
-};
 
-class vuxboot {
-  static const char* SIGNATURE;
+  void message(string text) {
+    pthread_mutex_lock(&_lock);
+    cout << prefix() << text << endl;
+    pthread_mutex_unlock(&_lock);
+  }
 
-public:
-  vuxboot(string filename, unsigned baud = B115200) : _debug(false) {
-    _fd = open(filename.c_str(), O_RDWR | O_NOCTTY);
-    if(_fd < 0) throw new io_error("cannot open port");
+  void warning(string text) {
+    pthread_mutex_lock(&_lock);
+    cerr << prefix() << text << endl;
+    pthread_mutex_unlock(&_lock);
+  }
 
-    // Serial initialization was written with FTDI USB-to-serial converters
-    // in mind. Anyway, who wants to use non-8n1 protocol?
+  // Multi-line text, such as vuxboot::describe() output.
+  void text(string text) {
+    istringstream in(text);
+    string line;
+    while(getline(in, line))
+      message(line);
+  }
 
-    tcgetattr(_fd, &_termios);
+  void begin(string what) {
+    _what = what;
+    _dots = false;
+    _pages = 0;
+    if(_progress && _tag == "")
+      cout << what << ": " << flush;
+  }
+
+  void step() {
+    _dots = true;
+    if(_progress && _tag == "")
+      cout << "." << flush;
+  }
 
-    termios tio = {0};
-    tio.c_iflag = IGNPAR;
-    tio.c_oflag = 0;
-    tio.c_cflag = baud | CLOCAL | CREAD | CS8;
-    tio.c_lflag = 0;
-    tio.c_cc[VMIN] = 1;
-    tio.c_cc[VTIME] = 0;
+  void end(unsigned count, string unit) {
+    ostringstream result;
+    result << count << " " << unit << ".";
 
-    tcflush(_fd, TCIFLUSH);
-    tcsetattr(_fd, TCSANOW, &tio);
+    if(!_progress)
+      return;
+    else if(_tag == "")
+      cout << (_dots ? " " : "") << result.str() << endl;
+    else
+      message(_what + ": " + result.str());
   }
 
-  ~vuxboot() {
-    tcsetattr(_fd, TCSANOW, &_termios);
-    close(_fd);
+  // A step for every ten pages written.
+  void page_written(unsigned page) {
+    if(_pages++ % 10 == 0)
+      step();
   }
 
-  bool get_debug() {
-    return _debug;
+private:
+  string prefix() {
+    return _tag == "" ? "" : _tag + ": ";
   }
 
-  void set_debug(bool new_debug) {
-    _debug = new_debug;
+  static pthread_mutex_t _lock;
+
+  string _tag, _what;
+  bool _dots, _progress;
+  unsigned _pages;
+};
+
+pthread_mutex_t console::_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool flash_read(vuxboot& bl, const job& j, console& con, flash_cache& cache) {
+  unsigned last_page = j.dump_all ? bl.flash_pages() :
+        bl.flash_pages() - bl.boot_pages();
+
+  con.begin("Reading flash");
+  long long start = monotonic_us();
+  memory_image flash(bl.page_words() * 2);
+  bl.read_flash_range(0, last_page, flash);
+  bl.statistics().phase("flash_read", start);
+  con.end(last_page, "pages");
+
+  if(cache.enabled()) {
+    for(int page = 0; page < last_page; page++)
+      cache.set(page, crc32(flash.page(page), flash.page_bytes()));
+    cache.save();
   }
 
-  void identify() {
-    write("s");
+  write_file(j.filename, j.format, flash, 0, j.record_bytes);
+  return true;
+}
 
-    // an unknown number of unknown characters may appear because of
-    // input buffer flushing when rebooting device
-    string s;
-    do {
-      s = read(1);
-    } while(s[0] != SIGNATURE[0]);
+// Checks that `pages' hold their contents from the image, and records
+// them in the journal if they do.
+bool verify_pages(vuxboot& bl, const memory_image& image,
+      const vector<unsigned>& pages, flash_journal& journal) {
+  if(pages.empty())
+    return true;
 
-    string signature = s + read(2); // one non-E plus two symbols
-    if(signature != SIGNATURE)
-      throw new protocol_error("wrong signature", signature);
+  long long start = monotonic_us();
+  bool verified = diff_pages(bl, image, pages).empty();
+  bl.statistics().phase("flash_verify", start);
 
-    string s_type = read(1);
-    if(s_type != "f" && s_type != "e")
-      throw new protocol_error("wrong type", s_type);
+  if(verified)
+    journal.commit(pages);
+  return verified;
+}
 
-    _has_eeprom = (s_type == "e");
-    if(_has_eeprom) {
-      string s_eesize = read(1);
-      _eeprom_bytes = 1 << s_eesize[0];
-      s_type += s_eesize;
+bool flash_write(vuxboot& bl, const job& j, console& con, flash_cache& cache,
+      flash_journal& journal) {
+  memory_image flash = *j.image;
+
+  unsigned page_bytes = bl.page_words() * 2;
+  flash.repage(page_bytes);
+  unsigned even_pages = flash.pages();
+
+  if(even_pages > bl.flash_pages() - bl.boot_pages()) {
+    con.warning("                         / ! \\      / ! \\       / ! \\");
+    if(!j.force) {
+      ostringstream pages;
+      pages << even_pages << " pages long; writing it will overwrite the bootloader";
+      con.warning("* Image is " + pages.str());
+
+      pages.str("");
+      pages << bl.flash_pages() - bl.boot_pages() << "-" << bl.flash_pages() - 1;
+      con.warning("* at pages " + pages.str() + ". " +
+            "Pass the -F flag if you really know what are you doing.");
+      con.warning("* Probably you will just overwrite first page of bootloader "
+            "and then everything");
+      con.warning("* will fail, leaving you with a nice brick.");
+      return false;
+    } else {
+      con.warning("* Shooting myself in the leg.");
     }
+  }
 
-    string s_flash_sizes = read(3);
-    _page_words = s_flash_sizes[0];
-    _flash_pages = 1 << s_flash_sizes[1];
-    _boot_pages = s_flash_sizes[2];
+  // the rest of application section is blank in the new image
+  unsigned app_pages = bl.flash_pages() - bl.boot_pages();
+  flash.extend(app_pages * page_bytes);
+
+  // Compare, write and verify are done in separate passes, so that
+  // writes can be pipelined without reads interleaving with them.
+  unsigned blank_crc = crc32(string(page_bytes, 0xff));
+  vector<unsigned> used, blank;
+  for(int page = 0; page < flash.pages(); page++) {
+    if(!flash.blank(page))
+      used.push_back(page);
+    else if(page < app_pages)
+      blank.push_back(page);
+  }
 
-    string s_checksum = read(1);
+  long long start = monotonic_us();
+
+  // Pages confirmed by an interrupted session with the same image are
+  // not looked at again, unless the device was changed since then.
+  unsigned image_crc = crc32(flash.data(), flash.length());
+  vector<unsigned> confirmed = journal.load(image_crc);
+  if(!confirmed.empty()) {
+    vector<unsigned> sample;
+    sample.push_back(confirmed.front());
+    sample.push_back(confirmed.back());
+    if(!diff_pages(bl, flash, sample).empty()) {
+      con.warning("device was changed since the interrupted session; starting over.");
+      confirmed.clear();
+    }
+  }
+  journal.start(image_crc, confirmed);
+
+  vector<unsigned> pending = without(used, confirmed);
+  bool cached = cache.enabled() && cache.consistent(bl);
+
+  vector<unsigned> changed;
+  if(cached) {
+    for(int i = 0; i < pending.size(); i++) {
+      unsigned page = pending[i];
+      if(!cache.has(page) ||
+            cache.get(page) != crc32(flash.page(page), page_bytes))
+        changed.push_back(page);
+    }
+  } else {
+    changed = diff_pages(bl, flash, pending);
+  }
 
-    string concat = signature + s_type + s_flash_sizes;
-    char checksum = 0;
-    for(int i = 0; i < concat.length(); i++)
-      checksum += concat[i];
+  // Pages which the image leaves blank are erased if they hold something
+  // else, as far as the cache or on-device checksums can tell cheaply.
+  vector<unsigned> stale, unknown, pending_blank = without(blank, confirmed);
+  for(int i = 0; i < pending_blank.size(); i++) {
+    unsigned page = pending_blank[i];
+    if(cached && cache.has(page)) {
+      if(cache.get(page) != blank_crc)
+        stale.push_back(page);
+    } else {
+      unknown.push_back(page);
+    }
+  }
+  if(bl.has_feature(vuxboot::FEATURE_CRC)) {
+    vector<unsigned> nonblank = diff_pages(bl, flash, unknown);
+    stale.insert(stale.end(), nonblank.begin(), nonblank.end());
+    sort(stale.begin(), stale.end());
+  }
 
-    if(checksum != s_checksum[0])
-      throw new protocol_error("bad checksum");
+  bl.statistics().phase("flash_preread", start);
+  bl.statistics().pages_skipped(used.size() - changed.size());
+  journal.commit(without(pending, changed));
+
+  if(!confirmed.empty()) {
+    ostringstream resumed;
+    resumed << "Resuming interrupted session; " << confirmed.size()
+            << " pages already written.";
+    con.message(resumed.str());
   }
 
-  void describe() {
-    cout << "Device capabilities:" << endl;
-    if(_has_eeprom)
-      cout << "  EEPROM: " << _eeprom_bytes << " bytes." << endl;
-    cout << "  Page size: " << _page_words << " words." << endl;
-    cout << "  Flash size: " << _flash_pages << " pages." << endl;
-    cout << "  Reserved area: " << _boot_pages << " pages (at end)." << endl;
+  con.begin("Writing flash");
+
+  // pages about to be written are unknown until verified
+  vector<unsigned> written = changed;
+  written.insert(written.end(), stale.begin(), stale.end());
+  sort(written.begin(), written.end());
+  if(cache.enabled()) {
+    for(int i = 0; i < written.size(); i++)
+      cache.forget(written[i]);
+    cache.save();
   }
 
-  string read_flash(unsigned page) {
-    if(page > flash_pages())
-      throw new input_error("flash page address too big");
+  // With a journal, pages are verified and recorded in batches, so that
+  // an interruption loses little work.
+  unsigned batch = changed.size();
+  if(journal.enabled())
+    batch = flash_journal::BATCH;
+  for(unsigned first = 0; first < changed.size(); first += batch) {
+    unsigned last = min(first + batch, unsigned(changed.size()));
+    vector<unsigned> pages(changed.begin() + first, changed.begin() + last);
+
+    start = monotonic_us();
+    bl.write_pages(flash, pages);
+    bl.statistics().phase("flash_write", start);
+
+    if(!verify_pages(bl, flash, pages, journal)) {
+      con.warning("verification failed!");
+      return false;
+    }
+  }
+
+  start = monotonic_us();
+  for(int i = 0; i < stale.size(); ) {
+    int run = 1;
+    while(i + run < stale.size() && stale[i + run] == stale[i] + run)
+      run++;
+
+    bl.erase_flash(stale[i], run);
+    con.step();
+    i += run;
+  }
+  bl.statistics().phase("flash_erase", start);
 
-    string req = "r";
-    req += char(page & 0xff);
-    req += char(page >> 8);
-    write(req);
+  if(!verify_pages(bl, flash, stale, journal)) {
+    con.warning("verification failed!");
+    return false;
+  }
+  journal.finish();
+
+  if(cache.enabled()) {
+    for(int i = 0; i < used.size(); i++)
+      cache.set(used[i], crc32(flash.page(used[i]), page_bytes));
+    for(int i = 0; i < stale.size(); i++)
+      cache.set(stale[i], blank_crc);
+    cache.save();
+  }
 
-    return read(_page_words * 2);
+  con.end(changed.size(), "pages");
+  if(!stale.empty()) {
+    ostringstream erased;
+    erased << "Erased " << stale.size() << " stale pages.";
+    con.message(erased.str());
   }
+  return true;
+}
 
-  void write_flash(unsigned page, string words) {
-    if(words.length() != _page_words * 2)
-      throw new error("flash page size mismatch");
+bool eeprom_read(vuxboot& bl, const job& j, console& con) {
+  if(!bl.has_eeprom())
+    throw feature_error("no eeprom");
+  if(j.offset > bl.eeprom_bytes())
+    throw input_error("eeprom offset too big");
 
-    string req = "w", status;
-    req += words;
-    req += char(page & 0xff);
-    req += char(page >> 8);
-    write(req);
+  unsigned length = j.has_length ? j.length : bl.eeprom_bytes() - j.offset;
 
-    status = read(1);
-    if(status != ".")
-      throw new hardware_error("cannot write flash");
+  long long start = monotonic_us();
+  string eeprom = bl.read_eeprom(j.offset, length);
+  bl.statistics().phase("eeprom_read", start);
+
+  // the file holds the range relative to the offset, as eeprom_write expects
+  write_file(j.filename, j.format, memory_image(eeprom.data(), eeprom.length()),
+        0, j.record_bytes);
+  return true;
+}
+
+bool eeprom_write(vuxboot& bl, const job& j, console& con) {
+  if(!bl.has_eeprom())
+    throw feature_error("no eeprom");
+
+  string new_eeprom = j.image->bytes(0, j.image->length());
+
+  if(j.offset > bl.eeprom_bytes() ||
+     new_eeprom.length() > bl.eeprom_bytes() - j.offset) {
+    con.warning("eeprom image is too big!");
+    return false;
   }
 
-  string read_eeprom() {
-    if(!_has_eeprom)
-      throw new feature_error("no eeprom");
+  // without an offset, the whole eeprom is rewritten
+  if(!j.has_offset)
+    new_eeprom.resize(bl.eeprom_bytes(), 0xff);
+
+  long long start = monotonic_us();
+  string old_eeprom = bl.read_eeprom(j.offset, new_eeprom.length());
+  bl.statistics().phase("eeprom_preread", start);
+
+  con.begin("Writing eeprom");
+  start = monotonic_us();
+
+  // coalesce changed bytes into runs written with one packet each
+  unsigned changed = 0;
+  for(int i = 0; i < new_eeprom.length(); ) {
+    if(old_eeprom[i] == new_eeprom[i]) {
+      i++;
+      continue;
+    }
+
+    int run = 1;
+    while(i + run < new_eeprom.length() && old_eeprom[i + run] != new_eeprom[i + run])
+      run++;
+
+    bl.write_eeprom_block(j.offset + i, new_eeprom.substr(i, run));
+    con.step();
 
-    write("R");
-    return read(_eeprom_bytes);
+    changed += run;
+    i += run;
   }
 
-  void write_eeprom(unsigned address, byte b) {
-    if(!_has_eeprom)
-      throw new feature_error("no eeprom");
-    if(address > _eeprom_bytes)
-      throw new input_error("eeprom address too big");
+  bl.statistics().phase("eeprom_write", start);
+  con.end(changed, "bytes");
 
-    string req = "W";
-    req += char(address & 0xff);
-    req += char(address >> 8);
-    req += char(b);
-    write(req);
+  start = monotonic_us();
+  bool verified = bl.read_eeprom(j.offset, new_eeprom.length()) == new_eeprom;
+  bl.statistics().phase("eeprom_verify", start);
+  if(!verified) {
+    con.warning("verification failed!");
+    return false;
+  }
+
+  return true;
+}
 
-    string status = read(1);
-    if(status != ".")
-      throw new hardware_error("cannot write eeprom");
+// Measurements of one benchmark phase over all runs.
+class bench_phase {
+public:
+  bench_phase(string name = "") : name(name), bytes(0), pages(0), requests(0) {}
+
+  void start(vuxboot& bl) {
+    stats& st = bl.statistics();
+    _bytes = st.bytes();
+    _pages = st.pages();
+    _requests = st.requests();
+    _start = monotonic_us();
   }
 
-  void reset() {
-    write("q");
+  void stop(vuxboot& bl) {
+    times.push_back(monotonic_us() - _start);
+
+    stats& st = bl.statistics();
+    bytes += st.bytes() - _bytes;
+    pages += st.pages() - _pages;
+    requests += st.requests() - _requests;
   }
 
-  bool has_eeprom() {
-    return _has_eeprom;
+  string name;
+  vector<long long> times;
+  unsigned long long bytes;
+  unsigned pages, requests;
+
+private:
+  long long _start;
+  unsigned long long _bytes;
+  unsigned _pages, _requests;
+};
+
+// Pseudo-random contents, the same on every run and host.
+string bench_data(unsigned length, unsigned seed) {
+  string data(length, 0);
+  for(unsigned i = 0; i < length; i++) {
+    seed = seed * 1103515245 + 12345;
+    data[i] = seed >> 16;
   }
+  return data;
+}
 
-  unsigned eeprom_bytes() {
-    return _eeprom_bytes;
+// Runs a standard workload `j.runs' times and reports times of each phase.
+// It goes through the same code as the regular actions do.
+bool bench(vuxboot& bl, const job& j, console& con) {
+  unsigned page_bytes = bl.page_words() * 2;
+  unsigned app_pages = bl.flash_pages() - bl.boot_pages();
+
+  // Alternate images differ in every byte, so that all pages are written.
+  // Sparse images change every eighth page of the preceding full one.
+  string data[2], eeprom_data[2];
+  data[0] = bench_data(app_pages * page_bytes, 1);
+  if(bl.has_eeprom())
+    eeprom_data[0] = bench_data(bl.eeprom_bytes(), 2);
+  for(unsigned i = 0; i < data[0].length(); i++)
+    data[1] += char(data[0][i] ^ 0x55);
+  for(unsigned i = 0; i < eeprom_data[0].length(); i++)
+    eeprom_data[1] += char(eeprom_data[0][i] ^ 0x55);
+
+  memory_image full[2], sparse[2], eeprom[2];
+  for(int k = 0; k < 2; k++) {
+    full[k] = memory_image(data[k].data(), data[k].length(), page_bytes);
+    eeprom[k] = memory_image(eeprom_data[k].data(), eeprom_data[k].length());
+
+    for(unsigned page = 0; page < app_pages; page += 8) {
+      for(unsigned i = page * page_bytes; i < (page + 1) * page_bytes; i++)
+        data[k][i] ^= 0xaa;
+    }
+    sparse[k] = memory_image(data[k].data(), data[k].length(), page_bytes);
   }
 
-  unsigned flash_pages() {
-    return _flash_pages;
+  job jj = j;
+  jj.filename = "/dev/null";
+  jj.format = storage::binary;
+  jj.dump_all = false;
+  jj.has_offset = jj.has_length = false;
+  jj.offset = 0;
+
+  // the cache would hide the cost of comparing
+  flash_cache cache;
+  flash_journal journal;
+
+  vector<bench_phase> phases;
+  phases.push_back(bench_phase("identify"));
+  phases.push_back(bench_phase("flash dump"));
+  phases.push_back(bench_phase("flash write"));
+  phases.push_back(bench_phase("sparse write"));
+  if(bl.has_eeprom()) {
+    phases.push_back(bench_phase("eeprom dump"));
+    phases.push_back(bench_phase("eeprom write"));
   }
 
-  unsigned boot_pages() {
-    return _boot_pages;
+  con.set_progress(false);
+  for(unsigned run = 0; run < j.runs; run++) {
+    phases[0].start(bl);
+    bl.identify();
+    phases[0].stop(bl);
+
+    phases[1].start(bl);
+    bool success = flash_read(bl, jj, con, cache);
+    phases[1].stop(bl);
+
+    jj.image = &full[run % 2];
+    phases[2].start(bl);
+    success = success && flash_write(bl, jj, con, cache, journal);
+    phases[2].stop(bl);
+
+    jj.image = &sparse[run % 2];
+    phases[3].start(bl);
+    success = success && flash_write(bl, jj, con, cache, journal);
+    phases[3].stop(bl);
+
+    if(bl.has_eeprom()) {
+      phases[4].start(bl);
+      success = success && eeprom_read(bl, jj, con);
+      phases[4].stop(bl);
+
+      jj.image = &eeprom[run % 2];
+      phases[5].start(bl);
+      success = success && eeprom_write(bl, jj, con);
+      phases[5].stop(bl);
+    }
+
+    if(!success) {
+      con.set_progress(true);
+      return false;
+    }
+  }
+  con.set_progress(true);
+
+  ostringstream report;
+  report << "Benchmark of " << j.runs << " runs:" << endl;
+  report << "  " << left << setw(14) << "phase" << right << setw(12) << "median"
+         << setw(12) << "p99" << setw(14) << "bytes/s" << setw(16) << "requests/page" << endl;
+  for(int i = 0; i < phases.size(); i++) {
+    bench_phase& phase = phases[i];
+
+    vector<long long> times = phase.times;
+    sort(times.begin(), times.end());
+    long long total = 0;
+    for(int k = 0; k < times.size(); k++)
+      total += times[k];
+
+    // nearest rank
+    long long median = times[(times.size() - 1) / 2];
+    long long p99 = times[(times.size() * 99 + 99) / 100 - 1];
+
+    report << "  " << left << setw(14) << phase.name << right << fixed << setprecision(2)
+           << setw(9) << median / 1000.0 << " ms" << setw(9) << p99 / 1000.0 << " ms"
+           << setw(14) << setprecision(0) << (total > 0 ? phase.bytes * 1e6 / total : 0);
+    if(phase.pages > 0)
+      report << setw(16) << setprecision(2) << double(phase.requests) / phase.pages;
+    else
+      report << setw(16) << "-";
+    report << endl;
   }
+  con.text(report.str());
+
+  return true;
+}
 
-  unsigned page_words() {
-    return _page_words;
+// Returns a name of the connected device, which tells it apart from
+// others as far as the job allows.
+string device_key(vuxboot& bl, const job& j) {
+  string key = bl.identity();
+  if(j.has_serial) {
+    string number = bl.read_eeprom(j.serial_addr, j.serial_len);
+
+    ostringstream serial;
+    serial << "-" << hex << setfill('0');
+    for(unsigned i = 0; i < number.length(); i++)
+      serial << setw(2) << unsigned(byte(number[i]));
+    key += serial.str();
   }
+  return key;
+}
 
-  string read(unsigned length, unsigned timeout=5) {
-    char data[length];
+// Opens the cache file for a device, if caching is enabled.
+flash_cache open_cache(string key, const job& j) {
+  if(j.cache_dir == "")
+    return flash_cache();
 
-    if(_debug)
-      cerr << "read(" << length << "): ";
+  mkdir(j.cache_dir.c_str(), 0777);
+  return flash_cache(j.cache_dir + "/" + key, j.has_serial);
+}
 
-    unsigned received = 0;
-    while(received < length) {
-      struct timeval to = {0};
-      to.tv_sec = timeout;
+// Runs a single action of a job on an identified device. Resets are only
+// noted in `do_reset', to be done when the session ends.
+bool run_action(vuxboot& bl, const job& j, console& con, flash_cache& cache,
+      flash_journal& journal, bool& do_reset) {
+  if(j.action == "flash_read" || j.action == "fr")
+    return flash_read(bl, j, con, cache);
+  else if(j.action == "flash_write" || j.action == "fw")
+    return flash_write(bl, j, con, cache, journal);
+  else if(j.action == "eeprom_read" || j.action == "er")
+    return eeprom_read(bl, j, con);
+  else if(j.action == "eeprom_write" || j.action == "ew")
+    return eeprom_write(bl, j, con);
+  else if(j.action == "reset" || j.action == "r")
+    do_reset = true;
+  else if(j.action == "bench")
+    return bench(bl, j, con);
+  return true;
+}
 
-      fd_set rfds, efds;
-      FD_ZERO(&rfds);
-      FD_SET(_fd, &rfds);
+// Runs the job against a device at `port'; returns exit status.
+// Statistics of the session are stored to `summary' as a JSON object.
+int run_session(string port, const job& j, console& con, string& summary) {
+  stats st(port, j.stats_stream);
+  trace tr;
+  int result = 1;
 
-      FD_ZERO(&efds);
-      FD_SET(_fd, &efds);
+  vuxboot* device = j.pool ? j.pool->take(port) : NULL;
+  bool fresh = (device == NULL), keep = false;
 
-      int retval = select(FD_SETSIZE, &rfds, NULL, &efds, &to);
-      if(retval == -1) {
-        throw new io_error("cannot select()");
-      } else if(retval == 0) {
-        throw new io_error("read timeout");
-      } else if(FD_ISSET(_fd, &efds)) {
-        throw new io_error("i/o error");
-      }
+  try {
+    // the device may have been reset or replaced since the last job
+    if(!fresh && !device->ping()) {
+      con.message("Open connection does not answer; reconnecting.");
+      delete device;
+      device = NULL;
+      fresh = true;
+    }
 
-      retval = ::read(_fd, data + received, length - received);
-      if(retval == -1) {
-        throw new io_error("cannot read()");
-      } else if(retval == 0) {
-        throw new io_error("read() == 0");
-      }
+    if(fresh)
+      device = new vuxboot(port, B115200, &st);
 
-      if(_debug) {
-        cerr << "{";
-        for(int i = 0; i < retval; i++) {
-          char val[3];
-          sprintf(val, "%02X", (unsigned char) *(data + received + i));
-          cerr << val << ' ';
-        }
-        for(int i = 0; i < retval; i++) {
-          char chr = *(data + received + i);
-          if(isgraph(chr))
-            cerr << chr;
-          else
-            cerr << '.';
-        }
-        cerr << "} ";
-      }
+    vuxboot& bl = *device;
+    bl.set_statistics(&st);
+    bl.set_debug(j.debug);
+    bl.set_listener(&con);
+    if(j.trace_file != "")
+      bl.set_trace(&tr);
 
-      received += retval;
+    if(fresh) {
+      if(j.init != "")
+        bl.write(j.init);
+
+      long long start = monotonic_us();
+      bl.identify();
+      st.phase("identify", start);
+    } else {
+      con.message("Reusing open connection.");
     }
 
-    if(_debug)
-      cerr << endl;
+    // Framing costs a CRC on every request and rules out eeprom block
+    // writes, so it is only used when asked for.
+    bool framed = j.framed && bl.has_feature(vuxboot::FEATURE_FRAMED);
+    if(j.framed && !framed)
+      con.warning("device cannot frame packets; going on without.");
+    if(bl.framed() != framed)
+      bl.set_framed(framed);
+
+    // an open device stays at the rate it was switched to
+    if(fresh && j.baud != 0 && bl.has_feature(vuxboot::FEATURE_BAUD)) {
+      ostringstream rate;
+      if(bl.switch_baud(j.baud)) {
+        rate << "Switched to " << bl.baud() << " baud.";
+        con.message(rate.str());
+      } else {
+        rate << "cannot switch to " << j.baud << " baud; staying at 115200.";
+        con.warning(rate.str());
+      }
+    }
 
-    return string(data, received);
-  }
+    ostringstream description;
+    bl.describe(description);
+    con.text(description.str());
+
+    string key = device_key(bl, j);
+    flash_cache cache = open_cache(key, j);
+    flash_journal journal(j.journal_file, key);
 
-  void write(string data) {
-    if(_debug) {
-      cerr << "write(" << data.length() << "): {";
-      for(int i = 0; i < data.length(); i++) {
-        char val[3];
-        sprintf(val, "%02X", data[i]);
-        if(i != 0)
-          cerr << ' ';
-        cerr << val;
+    bool success = true, do_reset = j.do_reset;
+    if(j.steps) {
+      for(unsigned i = 0; success && i < j.steps->size(); i++)
+        success = run_action(bl, (*j.steps)[i], con, cache, journal, do_reset);
+    } else {
+      success = run_action(bl, j, con, cache, journal, do_reset);
+    }
+
+    if(success) {
+      if(do_reset) {
+        con.message("Resetting device...");
+        bl.reset();
+      } else {
+        // an open device is probed unframed before it is used again
+        if(bl.framed())
+          bl.set_framed(false);
+        keep = true;
       }
-      cerr << ' ';
-      for(int i = 0; i < data.length(); i++) {
-        char chr = data[i];
-        if(isgraph(chr))
-          cerr << chr;
-        else
-          cerr << '.';
+
+      if(j.timing) {
+        ostringstream latency;
+        bl.describe_latency(latency);
+        con.text(latency.str());
       }
-      cerr << "}" << endl;
-    }
 
-    if(::write(_fd, data.c_str(), data.length()) != data.length()) {
-      throw new io_error("cannot write()");
+      result = 0;
     }
+  } catch(input_error& e) {
+    con.warning("input error: " + e.message());
+  } catch(io_error& e) {
+    con.warning("i/o error: " + e.message());
+  } catch(protocol_error& e) {
+    con.warning("protocol error: " + e.message());
+  } catch(hardware_error& e) {
+    con.warning("hardware error: " + e.message());
+  } catch(error& e) {
+    con.warning("internal error: " + e.message());
   }
 
-private:
-  bool _debug;
+  if(device && keep && j.pool) {
+    device->set_statistics(NULL);
+    device->set_listener(NULL);
+    device->set_trace(NULL);
+    j.pool->give(port, device);
+  } else {
+    delete device;
+  }
 
-  int _fd;
-  termios _termios;
+  if(j.trace_file != "" && !tr.save(j.trace_file)) {
+    con.warning("cannot write trace to `" + j.trace_file + "'");
+    result = 1;
+  }
+
+  summary = st.finish(result == 0);
+  return result;
+}
 
-  bool _has_eeprom;
-  unsigned _eeprom_bytes;
-  unsigned _page_words, _flash_pages, _boot_pages;
+struct gang_session {
+  string port;
+  job j;
+  vector<job> steps;
+  pthread_t thread;
+  int result;
+  string summary;
 };
 
-const char* vuxboot::SIGNATURE = "VuX";
+void* gang_thread(void* arg) {
+  gang_session* session = (gang_session*) arg;
+  console con(session->port);
+  session->result = run_session(session->port, session->j, con, session->summary);
+  return NULL;
+}
 
-string read_file(string filename, storage::format format) {
-  ios::openmode flags = ios::in;
-  if(format == storage::binary)
-    flags |= ios::binary | ios::ate;
+// Programs all devices in parallel, then prints a summary.
+int run_gang(vector<string> ports, job& j, vector<string>& summaries) {
+  vector<gang_session> sessions(ports.size());
+  for(unsigned i = 0; i < ports.size(); i++) {
+    sessions[i].port = ports[i];
+    sessions[i].j = j;
+    sessions[i].result = 1;
+
+    // every device gets a file of its own
+    string suffix = "." + ports[i].substr(ports[i].rfind('/') + 1);
+    if(j.action == "flash_read" || j.action == "fr" ||
+          j.action == "eeprom_read" || j.action == "er")
+      sessions[i].j.filename += suffix;
+    if(j.steps) {
+      sessions[i].steps = *j.steps;
+      sessions[i].j.steps = &sessions[i].steps;
+      for(unsigned k = 0; k < sessions[i].steps.size(); k++) {
+        job& step = sessions[i].steps[k];
+        if(step.action == "flash_read" || step.action == "fr" ||
+              step.action == "eeprom_read" || step.action == "er")
+          step.filename += suffix;
+      }
+    }
+    if(j.trace_file != "")
+      sessions[i].j.trace_file += suffix;
+    if(j.journal_file != "")
+      sessions[i].j.journal_file += suffix;
+  }
 
-  ifstream in(filename.c_str(), flags);
-  if(!in)
-    throw new io_error("cannot read from data file");
+  for(unsigned i = 0; i < sessions.size(); i++) {
+    if(pthread_create(&sessions[i].thread, NULL, gang_thread, &sessions[i]) != 0) {
+      cerr << "cannot start session for " << sessions[i].port << "!" << endl;
+      return 1;
+    }
+  }
 
-  if(format == storage::binary) {
-    unsigned size = (unsigned) in.tellg();
-    in.seekg(0);
+  for(unsigned i = 0; i < sessions.size(); i++) {
+    pthread_join(sessions[i].thread, NULL);
+    summaries.push_back(sessions[i].summary);
+  }
 
-    char data[size];
-    in.read(data, size);
+  unsigned failed = 0;
+  cout << "Summary:" << endl;
+  for(unsigned i = 0; i < sessions.size(); i++) {
+    cout << "  " << sessions[i].port << ": "
+         << (sessions[i].result == 0 ? "ok" : "FAILED") << endl;
+    if(sessions[i].result != 0)
+      failed++;
+  }
+  cout << sessions.size() - failed << " of " << sessions.size()
+       << " devices succeeded." << endl;
 
-    return string(data, size);
-  } else if(format == storage::ihex) {
-    byte* image = (byte*) malloc(1);
-    unsigned image_len = 0;
+  return failed > 0;
+}
 
-    while(in) {
-      string hdata;
-      getline(in, hdata, '\n');
+// Splits a comma-separated list of ports, expanding wildcards.
+vector<string> expand_ports(string spec) {
+  vector<string> ports;
+
+  istringstream in(spec);
+  string pattern;
+  while(getline(in, pattern, ',')) {
+    glob_t matches;
+    if(glob(pattern.c_str(), GLOB_NOCHECK, NULL, &matches) == 0) {
+      for(size_t i = 0; i < matches.gl_pathc; i++)
+        ports.push_back(matches.gl_pathv[i]);
+    }
+    globfree(&matches);
+  }
 
-      if(hdata[hdata.length()-1] == '\r')
-        hdata = hdata.substr(0, hdata.length() - 1);
+  return ports;
+}
 
-      if(hdata[0] != ':' || hdata.length() < 11 || hdata.length() % 2 != 1)
-        throw new input_error("invalid ihex data (format)");
+// Jobs are handed to a daemon as a message carrying standard streams of
+// the client, followed by its working directory and arguments, each ended
+// with NUL. The daemon answers with the exit status once the job is done.
+static const char JOB_TAG = 'J';
+
+bool socket_address(string path, sockaddr_un& addr) {
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(path.length() >= sizeof(addr.sun_path))
+    return false;
+  strcpy(addr.sun_path, path.c_str());
+  return true;
+}
 
-      unsigned blen = (hdata.length()-1)/2;
-      byte bdata[blen], chksum = 0;
+// Runs a command line on the devices of the daemon at `socket_path';
+// returns exit status of the job.
+int run_client(string socket_path, int argc, const char* const* argv) {
+  sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0 || !socket_address(socket_path, addr) ||
+        connect(fd, (sockaddr*) &addr, sizeof(addr)) < 0) {
+    cerr << "cannot connect to daemon at `" << socket_path << "'!" << endl;
+    return 1;
+  }
 
-      for(int j = 1, k = 0; j < hdata.length(); j += 2) {
-        string hbyte = hdata.substr(j, 2);
-        bdata[k++] = strtoul(hbyte.c_str(), NULL, 16);
-      }
+  char cwd[PATH_MAX];
+  if(!getcwd(cwd, sizeof(cwd))) {
+    cerr << "cannot get working directory!" << endl;
+    return 1;
+  }
 
-      if(blen != bdata[0] + 5)
-        throw new input_error("invalid ihex data (payload size)");
+  string request = string(cwd) + '\0';
+  for(int i = 1; i < argc; i++)
+    request += string(argv[i]) + '\0';
+
+  char tag = JOB_TAG;
+  iovec iov = { &tag, 1 };
+  int fds[3] = { 0, 1, 2 };
+  char control[CMSG_SPACE(sizeof(fds))];
+  msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  // output of the job goes straight to our descriptors, so nothing
+  // of ours may be left in buffers
+  cout.flush();
+  bool sent = sendmsg(fd, &msg, 0) == 1;
+  for(unsigned done = 0; sent && done < request.length(); ) {
+    ssize_t written = write(fd, request.data() + done, request.length() - done);
+    sent = written > 0;
+    done += written;
+  }
+  shutdown(fd, SHUT_WR);
 
-      for(int i = 0; i < blen-1; i++)
-        chksum += bdata[i];
+  char status;
+  if(!sent || read(fd, &status, 1) != 1) {
+    cerr << "daemon at `" << socket_path << "' dropped the job!" << endl;
+    close(fd);
+    return 1;
+  }
 
-      if((byte) (chksum + bdata[blen-1]) != 0)
-        throw new input_error("invalid ihex data (checksum)");
+  close(fd);
+  return status;
+}
 
-      byte ihex_len = bdata[0];
-      word ihex_addr = (bdata[1] << 8) + bdata[2];
-      byte ihex_type = bdata[3];
+// Receives a job sent by run_client(): descriptors of its standard
+// streams, and the working directory followed by arguments.
+bool receive_job(int fd, int fds[3], vector<string>& args) {
+  char tag;
+  iovec iov = { &tag, 1 };
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if(recvmsg(fd, &msg, 0) != 1)
+    return false;
+
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if(cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+    return false;
+  memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+  string request;
+  char buf[4096];
+  ssize_t length;
+  while((length = read(fd, buf, sizeof(buf))) > 0)
+    request.append(buf, length);
+
+  for(size_t pos = 0, end; (end = request.find('\0', pos)) != string::npos; pos = end + 1)
+    args.push_back(request.substr(pos, end - pos));
+
+  if(tag != JOB_TAG || length < 0 || args.empty()) {
+    for(int i = 0; i < 3; i++)
+      close(fds[i]);
+    return false;
+  }
+  return true;
+}
 
-      if(ihex_type == 0) { // data
-        if(image_len < ihex_addr + ihex_len)
-          image_len = ihex_addr + ihex_len;
-        image = (byte*) realloc(image, image_len);
+int run(int argc, const char* const* argv, device_pool* pool);
+
+// Runs jobs from clients at `socket_path' one at a time, keeping devices
+// at `ports' open in between. Output of a job goes to the client.
+int run_daemon(string socket_path, vector<string> ports) {
+  // clients may go away in the middle of a job
+  signal(SIGPIPE, SIG_IGN);
+
+  sockaddr_un addr;
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(listener >= 0 && socket_address(socket_path, addr))
+    unlink(socket_path.c_str());
+
+  // jobs run with our rights, so only we may connect
+  mode_t old_umask = umask(0077);
+  bool bound = listener >= 0 && socket_address(socket_path, addr) &&
+        bind(listener, (sockaddr*) &addr, sizeof(addr)) == 0;
+  umask(old_umask);
+  if(!bound || listen(listener, 8) < 0) {
+    cerr << "cannot listen at `" << socket_path << "'!" << endl;
+    return 1;
+  }
 
-        for(int i = 0; i < ihex_len; i++)
-          image[ihex_addr+i] = bdata[4+i];
-      } else if(ihex_type == 1) { // eof
-        return string((char*) image, image_len);
-      } else if(ihex_type == 3) { // .org
-        if(ihex_len != 4)
-          throw new input_error("invalid ihex data (invalid .org)");
+  device_pool pool(ports);
+  cout << "Serving " << ports.size() << " port(s) at " << socket_path << "." << endl;
 
-        unsigned int org = (bdata[4] << 24) + (bdata[5] << 16) +
-            (bdata[6] << 8) + bdata[7];
+  int own_fds[3] = { dup(0), dup(1), dup(2) }, own_cwd = open(".", O_RDONLY);
+  while(true) {
+    int client = accept(listener, NULL, NULL);
+    if(client < 0) {
+      if(errno == EINTR)
+        continue;
+      cerr << "cannot accept clients!" << endl;
+      return 1;
+    }
 
-        // ignore .org
-      } else {
-        throw new input_error("invalid ihex data (type)");
-      }
+    ucred peer;
+    socklen_t peer_length = sizeof(peer);
+    if(getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &peer_length) != 0 ||
+          peer.uid != getuid()) {
+      cerr << "refusing a job of another user!" << endl;
+      close(client);
+      continue;
     }
 
-    throw new input_error("invalid ihex data (unterminated file)");
-  }
-}
+    int fds[3];
+    vector<string> args;
+    if(!receive_job(client, fds, args)) {
+      close(client);
+      continue;
+    }
 
-void write_file(string filename, storage::format format, string data) {
-  ios::openmode flags = ios::out;
-  if(format == storage::binary)
-    flags |= ios::binary;
-
-  ofstream out(filename.c_str(), flags);
-  if(!out)
-    throw new io_error("cannot write to data file");
-
-  if(format == storage::binary) {
-    out << data;
-  } else if(format == storage::ihex) {
-    // data is always aligned by 16 bytes
-    for(int i = 0; i < data.length() / 16; i++) {
-      string subdata = data.substr(i * 16, 16);
-      if(subdata != string(16, '\xff')) {
-        char left[10], right[3];
-        word addr = i * 16;
-        byte checksum = 0x10 + byte(addr & 0xff) + byte(addr >> 8) + 0x01;
-
-        sprintf(left, ":10%04X01", addr);
-        out << left;
-
-        for(int j = 0; j < subdata.length(); j++) {
-          char middle[3];
-          sprintf(middle, "%02X", (byte) subdata[j]);
-          out << middle;
-
-          checksum += subdata[j];
-        }
-
-        sprintf(right, "%02X", (byte) (0x100 - checksum));
-        out << right;
-
-        out << endl;
-      }
+    for(int i = 0; i < 3; i++) {
+      dup2(fds[i], i);
+      close(fds[i]);
     }
 
-    out << ":00000001FF" << endl; // EOF*/
+    int status = 1;
+    if(chdir(args[0].c_str()) != 0) {
+      cerr << "cannot change to `" << args[0] << "'!" << endl;
+    } else {
+      vector<const char*> job_argv;
+      job_argv.push_back("vuxprog");
+      for(unsigned i = 1; i < args.size(); i++)
+        job_argv.push_back(args[i].c_str());
+      status = run(job_argv.size(), &job_argv[0], &pool);
+    }
+
+    // a client that went away leaves our streams failed; they must
+    // work again for the log and the next job
+    cout.flush();
+    cerr.flush();
+    cout.clear();
+    cerr.clear();
+    cin.clear();
+    clearerr(stdin);
+    for(int i = 0; i < 3; i++)
+      dup2(own_fds[i], i);
+    fchdir(own_cwd);
+
+    char reply = status;
+    write(client, &reply, 1);
+    close(client);
+
+    cout << "Job";
+    for(unsigned i = 1; i < args.size(); i++)
+      cout << " " << args[i];
+    cout << ": " << (status == 0 ? "ok" : "FAILED") << endl;
   }
 }
 
-int main(int argc, char* argv[]) {
-  picoopt::parser opts;
+void define_options(picoopt::parser& opts) {
   opts.option('s', true);
   opts.option('f', true);
   opts.option('i', true);
@@ -509,164 +1425,327 @@ int main(int argc, char* argv[]) {
   opts.option('a');
   opts.option('r');
   opts.option('d');
+  opts.option('c', true);
+  opts.option('n', true);
+  opts.option('o', true);
+  opts.option('l', true);
+  opts.option('b', true);
+  opts.option('t');
+  opts.option('j', true);
+  opts.option('J', true);
+  opts.option('T', true);
+  opts.option('R', true);
+  opts.option('k', true);
+  opts.option('D', true);
+  opts.option('C');
+}
 
-  if(!opts.parse(argc, argv) || opts.has('h') || !opts.valid() || (opts.args().size() != 2 &&
-        (opts.args().size() != 1 || (opts.args()[0] != "r" && opts.args()[0] != "reset")))) {
-    cout << "Usage: " << argv[0] << " <action> [argument] ..." << endl;
-    for(int i = 0; i < sizeof(usage) / sizeof(usage[0]); i++)
-        cout << usage[i] << endl;
-    return 1;
-  }
-
-  bool force = opts.has('F');
-  bool do_reset = opts.has('r');
-  bool dump_all = opts.has('a');
-  bool debug = opts.has('d');
+// options which concern a session, rather than one of its actions
+static const char SESSION_OPTIONS[] = "sirdcnbtjJTkDC";
+
+// Reads an action, its argument and options into `j', keeping settings
+// which are not given, and loads the input of write actions into
+// `images', which must outlive the job. Returns false after telling what
+// is wrong.
+bool read_action(picoopt::parser& opts, job& j, deque<memory_image>& images) {
+  j.action = opts.args()[0];
+  j.filename = opts.args().size() > 1 ? opts.args()[1] : "";
+  if(opts.has('F'))
+    j.force = true;
+  if(opts.has('a'))
+    j.dump_all = true;
 
-  storage::format format = storage::ihex;
   if(opts.has('f')) {
     string new_format = opts.get('f');
     if(new_format == "ihex") {
-      format = storage::ihex;
+      j.format = storage::ihex;
     } else if(new_format == "binary") {
-      format = storage::binary;
+      j.format = storage::binary;
+    } else if(new_format == "elf") {
+      j.format = storage::elf;
     } else {
       cerr << "unknown storage format `" << new_format << "'!" << endl;
-      return 1;
+      return false;
     }
   }
 
-  string port = "/dev/ttyUSB0";
-  if(opts.has('s'))
-    port = opts.get('s');
+  if(j.format == storage::elf && (j.action == "flash_read" || j.action == "fr" ||
+        j.action == "eeprom_read" || j.action == "er")) {
+    cerr << "cannot write elf files!" << endl;
+    return false;
+  }
 
-  try {
-    vuxboot bl(port);
-    bl.set_debug(debug);
+  if(opts.has('R')) {
+    j.record_bytes = strtoul(opts.get('R').c_str(), NULL, 0);
+    if(j.record_bytes != 16 && j.record_bytes != 32 && j.record_bytes != 64) {
+      cerr << "invalid ihex record size `" << opts.get('R') << "'!" << endl;
+      return false;
+    }
+  }
 
-    if(opts.has('i'))
-      bl.write(opts.get('i'));
+  if(opts.has('o')) {
+    j.has_offset = true;
+    j.offset = strtoul(opts.get('o').c_str(), NULL, 0);
+  }
+  if(opts.has('l')) {
+    j.has_length = true;
+    j.length = strtoul(opts.get('l').c_str(), NULL, 0);
+  }
 
-    bl.identify();
-    bl.describe();
+  if(j.action == "bench" && opts.args().size() > 1) {
+    j.runs = strtoul(j.filename.c_str(), NULL, 0);
+    if(j.runs == 0) {
+      cerr << "invalid number of runs `" << j.filename << "'!" << endl;
+      return false;
+    }
+  }
 
-    string action = opts.args()[0];
-    if(action == "flash_read" || action == "fr") {
-      string flash;
+  if(j.action == "flash_write" || j.action == "fw" ||
+        j.action == "eeprom_write" || j.action == "ew") {
+    try {
+      images.push_back(read_file(j.filename, j.format,
+            j.action == "flash_write" || j.action == "fw" ? storage::flash : storage::eeprom));
+      j.image = &images.back();
+    } catch(input_error& e) {
+      cerr << "input error: " << e.message() << endl;
+      return false;
+    } catch(io_error& e) {
+      cerr << "i/o error: " << e.message() << endl;
+      return false;
+    } catch(bad_alloc& e) {
+      cerr << "input error: image does not fit in memory" << endl;
+      return false;
+    }
+  }
 
-      unsigned last_page = dump_all ? bl.flash_pages() :
-            bl.flash_pages() - bl.boot_pages();
+  return true;
+}
 
-      cout << "Reading flash: " << flush;
-      for(int page = 0; page < last_page; page++) {
-        flash += bl.read_flash(page);
-        if(page % 10 == 1)
-          cout << "." << flush;
-      }
-      cout << endl;
-
-      write_file(opts.args()[1], format, flash);
-    } else if(action == "flash_write" || action == "fw") {
-      string flash = read_file(opts.args()[1], format);
-
-      unsigned page_bytes = bl.page_words() * 2;
-      unsigned even_pages = flash.length() / page_bytes + (flash.length() % page_bytes > 0);
-      flash.resize(even_pages * page_bytes, 0xff);
-
-      if(even_pages > bl.flash_pages() - bl.boot_pages()) {
-        cerr << "                         / ! \\      / ! \\       / ! \\" << endl;
-        if(!force) {
-          cerr << "* Image is " << even_pages << " pages long; writing it will "
-               << "overwrite the bootloader" << endl << "* at pages "
-               << bl.flash_pages() - bl.boot_pages() << "-" << bl.flash_pages() - 1
-               << ". "
-               << "Pass the -F flag if you really know what are you doing." << endl
-               << "* Probably you will just overwrite first page of bootloader "
-               << "and then everything" << endl
-               << "* will fail, leaving you with a nice brick." << endl;
-          return 1;
-        } else if(force) {
-          cerr << "* Shooting myself in the leg." << endl;
-        }
-      }
-      
-      cout << "Writing flash: " << flush;
-
-      unsigned changed = 0;
-      for(int page = 0; page < even_pages; page++) {
-        string new_page = flash.substr(page * page_bytes, page_bytes);
-        if(new_page != string(page_bytes, (char) 0xff)) {
-          string old_page = bl.read_flash(page);
-          if(old_page != new_page) {
-            bl.write_flash(page, new_page);
-            if(changed++ % 10 == 0)
-              cout << "." << flush;
-            if(bl.read_flash(page) != new_page) {
-              cerr << "verification failed!" << endl;
-              return 1;
-            }
-          }
-        }
+// Reads the actions of a script, one per line with its argument and
+// options, over the settings of `j'. Empty lines and lines starting with
+// `#' are skipped. All input images are loaded before any device is
+// touched, so that a bad one does not leave a half-programmed device.
+bool read_script(istream& in, const job& j, vector<job>& steps,
+      deque<memory_image>& images) {
+  string line;
+  for(unsigned number = 1; getline(in, line); number++) {
+    string first;
+    istringstream words(line);
+    if(!(words >> first) || first[0] == '#')
+      continue;
+
+    ostringstream where;
+    where << "line " << number << " of script `" << j.filename << "'";
+
+    picoopt::parser opts;
+    define_options(opts);
+    istringstream text(line);
+    if(!opts.parse(text) || opts.args().size() > 2) {
+      cerr << "invalid " << where.str() << "!" << endl;
+      return false;
+    }
+
+    for(const char* option = SESSION_OPTIONS; *option; option++) {
+      if(opts.has(*option)) {
+        cerr << "option -" << *option << " in " << where.str() <<
+                " applies to the whole session!" << endl;
+        return false;
       }
+    }
 
-      cout << " " << changed << " pages." << endl;
-    } else if(action == "eeprom_read" || action == "er") {
-      write_file(opts.args()[1], format, bl.read_eeprom());
-    } else if(action == "eeprom_write" || action == "ew") {
-      string old_eeprom = bl.read_eeprom();
-      string new_eeprom = read_file(opts.args()[1], format);
+    string action = opts.args()[0];
+    if(action != "flash_read" && action != "fr" &&
+          action != "flash_write" && action != "fw" &&
+          action != "eeprom_read" && action != "er" &&
+          action != "eeprom_write" && action != "ew" &&
+          action != "reset" && action != "r") {
+      cerr << "unknown action in " << where.str() << "!" << endl;
+      return false;
+    }
+    if(opts.args().size() != (action == "reset" || action == "r" ? 1 : 2)) {
+      cerr << "wrong number of arguments in " << where.str() << "!" << endl;
+      return false;
+    }
 
-      if(new_eeprom.length() > old_eeprom.length()) {
-        cerr << "eeprom image is too big!" << endl;
-        return 1;
-      }
+    job step = j;
+    if(!read_action(opts, step, images)) {
+      cerr << "(in " << where.str() << ")" << endl;
+      return false;
+    }
+    steps.push_back(step);
+  }
 
-      new_eeprom.resize(old_eeprom.length(), 0xff);
+  if(steps.empty()) {
+    cerr << "script `" << j.filename << "' has no actions!" << endl;
+    return false;
+  }
+  return true;
+}
 
-      cout << "Writing eeprom: " << flush;
+// Runs a command line; `pool' holds open devices when run by a daemon.
+int run(int argc, const char* const* argv, device_pool* pool) {
+  picoopt::parser opts;
+  define_options(opts);
 
-      unsigned changed = 0;
-      for(int i = 0; i < new_eeprom.length(); i++) {
-        if(old_eeprom[i] != new_eeprom[i]) {
-          bl.write_eeprom(i, new_eeprom[i]);
-          if(changed++ % 10 == 0)
-            cout << "." << flush;
-        }
-      }
+  if(!opts.parse(argc, argv) || opts.has('h') || !opts.valid() || (opts.args().size() != 2 &&
+        (opts.args().size() != 1 || (opts.args()[0] != "r" && opts.args()[0] != "reset" &&
+                                     opts.args()[0] != "bench")))) {
+    cout << "Usage: " << argv[0] << " <action> [argument] ..." << endl;
+    for(int i = 0; i < sizeof(usage) / sizeof(usage[0]); i++)
+        cout << usage[i] << endl;
+    return 1;
+  }
 
-      cout << " " << changed << " bytes." << endl;
+  // a daemon is handed the whole command line, and ignores -D
+  if(opts.has('D') && pool == NULL)
+    return run_client(opts.get('D'), argc, argv);
+
+  job j;
+  j.do_reset = opts.has('r');
+  j.debug = opts.has('d');
+  j.timing = opts.has('t');
+  j.framed = opts.has('C');
+  j.init = opts.get('i');
+  j.baud = strtoul(opts.get('b').c_str(), NULL, 0);
+  j.cache_dir = opts.get('c');
+  j.trace_file = opts.get('T');
+  j.journal_file = opts.get('k');
+  j.pool = pool;
+  j.steps = NULL;
+  j.image = NULL;
+
+  j.force = j.dump_all = false;
+  j.format = storage::ihex;
+  j.record_bytes = 16;
+  j.has_offset = j.has_length = false;
+  j.offset = j.length = 0;
+  j.runs = 5;
+
+  j.action = opts.args()[0];
+  if(opts.args().size() > 1)
+    j.filename = opts.args()[1];
+
+  if(j.action == "trace")
+    return !trace_print(j.filename, cout);
+  else if(j.action == "replay")
+    return !trace_replay(j.filename, cout);
+
+  if(j.action != "flash_read" && j.action != "fr" &&
+        j.action != "flash_write" && j.action != "fw" &&
+        j.action != "eeprom_read" && j.action != "er" &&
+        j.action != "eeprom_write" && j.action != "ew" &&
+        j.action != "reset" && j.action != "r" && j.action != "bench" &&
+        j.action != "script" && j.action != "daemon") {
+    cerr << "unknown action!" << endl;
+    return 1;
+  }
 
-      if(bl.read_eeprom() != new_eeprom) {
-        cerr << "verification failed!" << endl;
-        return 1;
-      }
-    } else if(action == "reset" || action == "r") {
-      do_reset = true;
-    } else {
-      cerr << "unknown action!" << endl;
+  vector<string> ports;
+  if(opts.has('s'))
+    ports = expand_ports(opts.get('s'));
+  else if(pool)
+    ports = pool->ports();
+  else
+    ports.push_back("/dev/ttyUSB0");
+
+  if(ports.empty()) {
+    cerr << "no ports match `" << opts.get('s') << "'!" << endl;
+    return 1;
+  }
+
+  if(j.action == "daemon") {
+    if(pool) {
+      cerr << "a daemon cannot start another one!" << endl;
       return 1;
     }
+    return run_daemon(j.filename, ports);
+  }
 
-    if(do_reset) {
-      cout << "Resetting device..." << endl;
-      bl.reset();
+  for(unsigned i = 0; pool && i < ports.size(); i++) {
+    if(!pool->owns(ports[i])) {
+      cerr << "port `" << ports[i] << "' is not served by the daemon!" << endl;
+      return 1;
     }
-  } catch(input_error *e) {
-    cerr << "input error: " << e->message() << endl;
-    return 1;
-  } catch(io_error *e) {
-    cerr << "i/o error: " << e->message() << endl;
-    return 1;
-  } catch(protocol_error *e) {
-    cerr << "protocol error: " << e->message() << endl;
-    return 1;
-  } catch(hardware_error *e) {
-    cerr << "hardware error: " << e->message() << endl;
+  }
+
+  j.has_serial = opts.has('n');
+  j.serial_addr = j.serial_len = 0;
+  if(j.has_serial) {
+    string serial = opts.get('n');
+    char *sep, *end;
+    j.serial_addr = strtoul(serial.c_str(), &sep, 0);
+    if(*sep == ':')
+      j.serial_len = strtoul(sep + 1, &end, 0);
+    if(*sep != ':' || *end != 0 || j.serial_len == 0) {
+      cerr << "invalid serial number location `" << serial << "'!" << endl;
+      return 1;
+    }
+  }
+
+  // parallel sessions would race on a shared cache file
+  if(ports.size() > 1 && j.cache_dir != "" && !j.has_serial) {
+    cerr << "-c needs -n when several devices are programmed at once!" << endl;
     return 1;
-  } catch(error *e) {
-    cerr << "internal error: " << e->message() << endl;
+  }
+
+  deque<memory_image> images;
+  if(!read_action(opts, j, images))
     return 1;
+
+  vector<job> steps;
+  if(j.action == "script") {
+    ifstream file;
+    if(j.filename != "-")
+      file.open(j.filename.c_str());
+    if(j.filename != "-" && !file) {
+      cerr << "cannot read script `" << j.filename << "'!" << endl;
+      return 1;
+    }
+
+    if(!read_script(j.filename == "-" ? cin : file, j, steps, images))
+      return 1;
+    j.steps = &steps;
+  }
+
+  ofstream stats_file;
+  j.stats_stream = NULL;
+  if(opts.has('J')) {
+    stats_file.open(opts.get('J').c_str());
+    if(!stats_file) {
+      cerr << "cannot open `" << opts.get('J') << "'!" << endl;
+      return 1;
+    }
+    j.stats_stream = &stats_file;
   }
 
-  return 0;
+  int result;
+  vector<string> summaries;
+  if(ports.size() > 1) {
+    result = run_gang(ports, j, summaries);
+  } else {
+    console con;
+    summaries.push_back("");
+    result = run_session(ports[0], j, con, summaries[0]);
+  }
+
+  if(opts.has('j')) {
+    ostringstream json;
+    json << "{\"sessions\": [";
+    for(unsigned i = 0; i < summaries.size(); i++)
+      json << (i ? ", " : "") << summaries[i];
+    json << "]}";
+
+    ofstream out(opts.get('j').c_str());
+    out << json.str() << endl;
+    if(!out) {
+      cerr << "cannot write `" << opts.get('j') << "'!" << endl;
+      return 1;
+    }
+  }
+
+  return result;
+}
+
+int main(int argc, char* argv[]) {
+  return run(argc, argv, NULL);
 }
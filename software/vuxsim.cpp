@@ -0,0 +1,773 @@
+/*
+ * Copyright (c) 2010 Peter Zotov <whitequark@whitequark.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Software model of a device running VuXboot, for testing and measuring
+// vuxprog without hardware. It serves the protocol on a pseudo-terminal
+// and models the serial line, flash and eeprom write times, and the
+// receive ring which queues bytes while the device is busy.
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdio>
+#include "picoopt.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+
+using namespace std;
+
+typedef unsigned char byte;
+
+static const char* usage[] = {
+  "",
+  "  VuXsim simulates a device running VuXboot on a pseudo-terminal,",
+  "    which name is printed on start.",
+  "",
+  "  Options:",
+  "    -p WORDS\tset page size in words; default is 32",
+  "    -n PAGES\tset flash size in pages; default is 128",
+  "    -k PAGES\tset bootloader size in pages; default is 16",
+  "    -e BYTES\tset eeprom size; 0 means no eeprom; default is 512",
+  "    -F MASK\tset supported features; default is 0x1ff (all)",
+  "    -R BYTES\tset size of the receive ring; default is 256",
+  "    -c HZ\tset clock frequency; default is 16000000",
+  "    -b BAUD\tset power-on baud rate; default is 115200;",
+  "    \t\t0 disables modelling of the serial line",
+  "    -w USEC\tset time of flash page erase or write; default is 4000",
+  "    -W USEC\tset time of eeprom byte write; default is 8500",
+  "    -x PERMILLE\tdrop received bytes with given probability",
+  "    -C PERMILLE\tflip a bit of received bytes with given probability",
+  "    -g PERMILLE\treplace sent bytes with garbage with given probability",
+  "    -K N\t\tflip a bit of the page data of the N-th `w' or `p' packet",
+  "    -S SEED\tseed random number generator of fault injection",
+  "    -v\t\tlog commands to standard error",
+  ""
+};
+
+// CRC-32 as computed by the `c' command.
+unsigned crc32(string data) {
+  unsigned crc = 0xffffffff;
+  for(int i = 0; i < data.length(); i++) {
+    crc ^= byte(data[i]);
+    for(int j = 0; j < 8; j++)
+      crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320 : 0);
+  }
+  return ~crc;
+}
+
+// CRC-16 of framed packets.
+unsigned crc16(unsigned crc, string data) {
+  for(int i = 0; i < data.length(); i++) {
+    crc ^= byte(data[i]);
+    for(int j = 0; j < 8; j++)
+      crc = (crc >> 1) ^ (crc & 1 ? 0x8408 : 0);
+  }
+  return crc;
+}
+
+long long monotonic_us() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void sleep_until(long long time) {
+  timespec ts;
+  ts.tv_sec = time / 1000000;
+  ts.tv_nsec = time % 1000000 * 1000;
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+unsigned ln2(unsigned value) {
+  unsigned bits = 0;
+  while(value > 1) {
+    value >>= 1;
+    bits++;
+  }
+  return bits;
+}
+
+struct geometry {
+  unsigned page_words, flash_pages, boot_pages, eeprom_bytes;
+  unsigned features, ring_bytes, f_cpu, baud;
+  long long flash_us, eeprom_us;
+  unsigned drop, corrupt, garble, corrupt_packet;
+  bool verbose;
+};
+
+class device {
+public:
+  device(const geometry& g) : _g(g),
+        _flash(g.page_words * 2 * g.flash_pages, 0xff), _eeprom(g.eeprom_bytes, 0xff),
+        _master(-1), _slave(-1), _packets(0), _corrupt_next(false) {
+    reset();
+  }
+
+  ~device() {
+    if(_slave != -1)
+      close(_slave);
+    if(_master != -1)
+      close(_master);
+  }
+
+  // Creates the pseudo-terminal; returns its name, or "" on failure.
+  string open() {
+    _master = posix_openpt(O_RDWR | O_NOCTTY);
+    if(_master == -1 || grantpt(_master) == -1 || unlockpt(_master) == -1)
+      return "";
+
+    // the slave end is kept open, so that hosts may come and go
+    string name = ptsname(_master);
+    _slave = ::open(name.c_str(), O_RDWR | O_NOCTTY);
+
+    termios settings;
+    if(_slave == -1 || tcgetattr(_slave, &settings) == -1)
+      return "";
+    cfmakeraw(&settings);
+    if(tcsetattr(_slave, TCSANOW, &settings) == -1)
+      return "";
+
+    return name;
+  }
+
+  void run() {
+    while(true) {
+      _crc = 0;
+      char command = receive(1)[0];
+      switch(command) {
+        case 's': signature(); break;
+        case 'v': features(); break;
+        case 'w': write_flash(false); break;
+        case 'p': write_flash(true); break;
+        case 'z': write_flash_rle(); break;
+        case 'x': erase_flash(); break;
+        case 'r': read_flash(1); break;
+        case 'b': read_flash(0); break;
+        case 'c': crc_flash(); break;
+        case 'W': write_eeprom(false); break;
+        case 'P': write_eeprom(true); break;
+        case 'R': read_eeprom(false); break;
+        case 'B': read_eeprom(true); break;
+        case 'u': switch_baud(); break;
+        case 'f': framed(); break;
+        case 'q':
+          if(!accept())
+            break;
+          log("q: reset");
+          reset();
+          break;
+        default:
+          log(string("unknown command ") + command);
+          send("E");
+      }
+    }
+  }
+
+private:
+  enum feature {
+    FEATURE_PIPELINE = 1 << 0,
+    FEATURE_BULK_READ = 1 << 1,
+    FEATURE_CRC = 1 << 2,
+    FEATURE_EEPROM_BLOCK = 1 << 3,
+    FEATURE_EEPROM_RANGE = 1 << 4,
+    FEATURE_BAUD = 1 << 5,
+    FEATURE_RLE = 1 << 6,
+    FEATURE_ERASE = 1 << 7,
+    FEATURE_FRAMED = 1 << 8
+  };
+
+  void reset() {
+    _baud = _g.baud;
+    _framed = false;
+    _queued = "";
+    erase_buffer();
+    _rx_clock = _tx_clock = 0;
+  }
+
+  // In framed mode, receives the CRC which ends a request and answers
+  // whether it matches; the request is to be dropped if not.
+  bool accept() {
+    if(!_framed)
+      return true;
+
+    receive(2);
+    if(_crc != 0) {
+      log("bad crc; nak");
+      erase_buffer();
+      send("N");
+      return false;
+    }
+
+    send(".");
+    return true;
+  }
+
+  // In framed mode, ends a reply with its CRC.
+  void send_crc() {
+    if(!_framed)
+      return;
+
+    unsigned crc = _crc;
+    string trailer;
+    trailer += char(crc & 0xff);
+    trailer += char(crc >> 8);
+    send(trailer);
+  }
+
+  bool has(feature f, char command) {
+    if(_g.features & f)
+      return true;
+
+    log(string("unsupported command ") + command);
+    send("E");
+    return false;
+  }
+
+  void signature() {
+    string sig = "VuX";
+    sig += _g.eeprom_bytes ? 'e' : 'f';
+    if(_g.eeprom_bytes)
+      sig += char(ln2(_g.eeprom_bytes));
+    sig += char(_g.page_words);
+    sig += char(ln2(_g.flash_pages));
+    sig += char(_g.boot_pages);
+
+    byte checksum = 0;
+    for(int i = 0; i < sig.length(); i++)
+      checksum += sig[i];
+    sig += char(checksum);
+
+    log("s");
+    send(sig);
+  }
+
+  void features() {
+    if(_g.features == 0) {
+      log("v: no features");
+      send("E");
+      return;
+    }
+
+    string info = "v";
+    info += char(_g.features);
+    info += char(_g.features >> 8);
+    info += char(ln2(_g.ring_bytes));
+    if(_g.features & FEATURE_BAUD) {
+      for(int i = 0; i < 4; i++)
+        info += char(_g.f_cpu >> (i * 8));
+    }
+
+    log("v");
+    send(info);
+  }
+
+  void write_flash(bool pipelined) {
+    if(pipelined && !has(FEATURE_PIPELINE, 'p'))
+      return;
+
+    string sequence = pipelined ? receive(1) : "";
+    _corrupt_next = ++_packets == _g.corrupt_packet;
+    load_buffer(receive(_g.page_words * 2));
+    unsigned page = receive_word();
+    if(!accept())
+      return;
+    program(page, pipelined ? "p" : "w");
+
+    send("." + sequence);
+    send_crc();
+  }
+
+  // Words go to the SPM page buffer as they arrive. A word which was
+  // loaded already keeps its value until the buffer is erased.
+  void load_buffer(string data) {
+    for(unsigned i = 0; i < _g.page_words; i++) {
+      if(_loaded[i]) {
+        log("page buffer word loaded twice; keeping the old one");
+        continue;
+      }
+      _buffer.replace(i * 2, 2, data, i * 2, 2);
+      _loaded[i] = true;
+    }
+  }
+
+  void erase_buffer() {
+    _buffer.assign(_g.page_words * 2, 0xff);
+    _loaded.assign(_g.page_words, false);
+  }
+
+  // Programs the page buffer, which is erased afterwards.
+  void program(unsigned page, string command) {
+    ostringstream message;
+    message << command << ": page " << page;
+    if(page >= _g.flash_pages - _g.boot_pages)
+      message << " (overwriting bootloader!)";
+    log(message.str());
+
+    // erase, then write
+    busy(_g.flash_us);
+    busy(_g.flash_us);
+    if(page < _g.flash_pages)
+      _flash.replace(page * _buffer.length(), _buffer.length(), _buffer);
+    erase_buffer();
+  }
+
+  void write_flash_rle() {
+    if(!has(FEATURE_RLE, 'z'))
+      return;
+
+    string sequence = receive(1);
+    string data;
+    while(data.length() < _g.page_words * 2) {
+      unsigned control = byte(receive(1)[0]);
+      if(control < 0x80) {
+        data += receive((control + 1) * 2);
+      } else {
+        string word = receive(2);
+        for(unsigned i = 0; i < control - 0x7f; i++)
+          data += word;
+      }
+    }
+
+    if(data.length() != _g.page_words * 2)
+      log("z: runs cross the end of page");
+    data.resize(_g.page_words * 2);
+    load_buffer(data);
+    unsigned page = receive_word();
+    if(!accept())
+      return;
+    program(page, "z");
+
+    send("." + sequence);
+    send_crc();
+  }
+
+  void erase_flash() {
+    if(!has(FEATURE_ERASE, 'x'))
+      return;
+
+    unsigned page = receive_word(), count = receive_count();
+    if(!accept())
+      return;
+
+    ostringstream message;
+    message << "x: page " << page << ", " << count << " pages";
+    log(message.str());
+
+    unsigned page_bytes = _g.page_words * 2;
+    for(unsigned i = page; i < page + count; i++) {
+      busy(_g.flash_us);
+      if(i < _g.flash_pages)
+        _flash.replace(i * page_bytes, page_bytes, page_bytes, 0xff);
+    }
+
+    send(".");
+    send_crc();
+  }
+
+  // Sends `count' pages, or as many as requested if `count' is 0.
+  void read_flash(unsigned count) {
+    if(count == 0 && !has(FEATURE_BULK_READ, 'b'))
+      return;
+
+    unsigned page = receive_word();
+    if(count == 0)
+      count = receive_count();
+    if(!accept())
+      return;
+
+    ostringstream message;
+    message << (count == 1 ? "r" : "b") << ": page " << page << ", " << count << " pages";
+    log(message.str());
+
+    string data;
+    for(unsigned i = 0; i < count; i++)
+      data += flash_page(page + i);
+    send(data);
+    send_crc();
+  }
+
+  void crc_flash() {
+    if(!has(FEATURE_CRC, 'c'))
+      return;
+
+    unsigned page = receive_word(), count = receive_count();
+    if(!accept())
+      return;
+
+    ostringstream message;
+    message << "c: page " << page << ", " << count << " pages";
+    log(message.str());
+
+    for(unsigned i = 0; i < count; i++) {
+      // about ten cycles per bit
+      busy((long long) 80 * _g.page_words * 2 * 1000000 / _g.f_cpu);
+
+      unsigned crc = crc32(flash_page(page + i));
+      string result;
+      for(int k = 0; k < 4; k++)
+        result += char(crc >> (k * 8));
+      send(result);
+    }
+    send_crc();
+  }
+
+  void write_eeprom(bool block) {
+    if(block && !has(FEATURE_EEPROM_BLOCK, 'P'))
+      return;
+
+    // blocks would be written before their CRC is checked
+    if(block && _framed) {
+      log("P: refused in framed mode");
+      send("E");
+      return;
+    }
+
+    unsigned address = receive_word();
+    unsigned count = block ? receive_count() : 1;
+
+    ostringstream message;
+    message << (block ? "P" : "W") << ": address " << address << ", " << count << " bytes";
+    log(message.str());
+
+    // bytes are written as they arrive
+    for(unsigned i = 0; i < count; i++) {
+      char value = receive(1)[0];
+      if(!block && !accept())
+        return;
+      busy(_g.eeprom_us);
+      if(address + i < _eeprom.length())
+        _eeprom[address + i] = value;
+    }
+
+    send(".");
+    send_crc();
+  }
+
+  void read_eeprom(bool range) {
+    if(range && !has(FEATURE_EEPROM_RANGE, 'B'))
+      return;
+
+    unsigned address = 0, count = _eeprom.length();
+    if(range) {
+      address = receive_word();
+      count = receive_count();
+    }
+    if(!accept())
+      return;
+
+    ostringstream message;
+    message << (range ? "B" : "R") << ": address " << address << ", " << count << " bytes";
+    log(message.str());
+
+    string data;
+    for(unsigned i = 0; i < count; i++)
+      data += address + i < _eeprom.length() ? _eeprom[address + i] : char(0xff);
+    send(data);
+    send_crc();
+  }
+
+  void switch_baud() {
+    if(!has(FEATURE_BAUD, 'u'))
+      return;
+
+    unsigned ubrr = receive_word();
+    bool u2x = receive(1)[0] != 0;
+    if(!accept())
+      return;
+    send(".");
+    send_crc();
+
+    if(ubrr == 0xffff)
+      _baud = _g.baud;
+    else
+      _baud = _g.f_cpu / ((u2x ? 8 : 16) * (ubrr + 1));
+
+    ostringstream message;
+    message << "u: " << _baud << " baud";
+
+    string confirm;
+    if(!receive(1, 500000, confirm) || confirm != "u") {
+      message << " not confirmed";
+      _baud = _g.baud;
+    } else {
+      send("U");
+    }
+
+    log(message.str());
+  }
+
+  void framed() {
+    if(!has(FEATURE_FRAMED, 'f'))
+      return;
+
+    // the mode is repeated complemented, lest stray bytes switch it
+    string mode = receive(2);
+    if(byte(mode[0]) != byte(~mode[1])) {
+      log("f: bad mode");
+      send("E");
+      return;
+    }
+
+    _framed = mode[0] & 1;
+    log(_framed ? "f: framed mode on" : "f: framed mode off");
+    send(".");
+  }
+
+  string flash_page(unsigned page) {
+    unsigned page_bytes = _g.page_words * 2;
+    if(page >= _g.flash_pages)
+      return string(page_bytes, 0xff);
+    return _flash.substr(page * page_bytes, page_bytes);
+  }
+
+  unsigned receive_word() {
+    string data = receive(2);
+    return byte(data[0]) | (byte(data[1]) << 8);
+  }
+
+  unsigned receive_count() {
+    unsigned count = receive_word();
+    if(count == 0) {
+      log("count of zero means 65536");
+      count = 0x10000;
+    }
+    return count;
+  }
+
+  string receive(unsigned length) {
+    string data;
+    receive(length, -1, data);
+    if(_corrupt_next) {
+      log("corrupted page data");
+      data[0] ^= 1;
+      _corrupt_next = false;
+    }
+    if(_framed)
+      _crc = crc16(_crc, data);
+    return data;
+  }
+
+  // Receives `length' bytes at the current baud rate. Returns false if
+  // they did not arrive in `timeout' microseconds.
+  bool receive(unsigned length, long long timeout, string& data) {
+    long long deadline = monotonic_us() + timeout;
+
+    while(data.length() < length) {
+      if(!_queued.empty()) {
+        unsigned chunk = min((size_t) length - data.length(), _queued.length());
+        data += _queued.substr(0, chunk);
+        _queued.erase(0, chunk);
+        continue;
+      }
+
+      if(timeout >= 0) {
+        long long left = deadline - monotonic_us();
+        pollfd pfd = { _master, POLLIN, 0 };
+        if(left <= 0 || poll(&pfd, 1, (left + 999) / 1000) == 0)
+          return false;
+      }
+
+      char buffer[4096];
+      int retval = read(_master, buffer, min((size_t) length - data.length(), sizeof(buffer)));
+      if(retval == -1) {
+        if(errno == EINTR)
+          continue;
+        perror("read");
+        exit(1);
+      }
+
+      // bytes take their time on the line, back to back
+      if(_baud != 0) {
+        _rx_clock = max(_rx_clock, monotonic_us()) + byte_us() * retval;
+        sleep_until(_rx_clock);
+      }
+
+      for(int i = 0; i < retval; i++) {
+        if(rand() % 1000 < _g.drop) {
+          log("dropped received byte");
+        } else if(rand() % 1000 < _g.corrupt) {
+          log("corrupted received byte");
+          data += char(buffer[i] ^ (1 << rand() % 8));
+        } else {
+          data += buffer[i];
+        }
+      }
+    }
+
+    return true;
+  }
+
+  void send(string data) {
+    if(_framed)
+      _crc = crc16(_crc, data);
+
+    for(int i = 0; i < data.length(); i++) {
+      if(rand() % 1000 < _g.garble) {
+        log("garbled sent byte");
+        data[i] = rand();
+      }
+    }
+
+    if(_baud != 0) {
+      _tx_clock = max(_tx_clock, monotonic_us()) + byte_us() * data.length();
+      sleep_until(_tx_clock);
+    }
+
+    for(unsigned done = 0; done < data.length(); ) {
+      int retval = write(_master, data.data() + done, data.length() - done);
+      if(retval == -1) {
+        if(errno == EINTR)
+          continue;
+        perror("write");
+        exit(1);
+      }
+      done += retval;
+    }
+  }
+
+  // Spends `time' microseconds writing flash or eeprom. Meanwhile, the
+  // device queues received bytes into the ring; any which do not fit
+  // there are lost.
+  void busy(long long time) {
+    usleep(time);
+
+    int available;
+    if(ioctl(_master, FIONREAD, &available) == -1)
+      available = 0;
+
+    unsigned arrived = available;
+    if(_baud != 0 && arrived > time / byte_us())
+      arrived = time / byte_us();
+    if(arrived == 0)
+      return;
+
+    string data;
+    receive(arrived, 0, data);
+    _queued += data;
+
+    // one slot of the ring is always empty, and the uart holds one byte more
+    if(_queued.length() > _g.ring_bytes) {
+      ostringstream message;
+      message << "ring overflow: " << _queued.length() - _g.ring_bytes << " bytes lost";
+      log(message.str());
+      _queued.erase(_g.ring_bytes);
+    }
+  }
+
+  double byte_us() {
+    return 10 * 1000000.0 / _baud;
+  }
+
+  void log(string message) {
+    if(_g.verbose)
+      cerr << message << endl;
+  }
+
+  geometry _g;
+  string _flash, _eeprom;
+  int _master, _slave;
+
+  unsigned _baud;
+  bool _framed;
+  unsigned _crc;
+  string _queued;
+  long long _rx_clock, _tx_clock;
+
+  string _buffer;
+  vector<bool> _loaded;
+  unsigned _packets;
+  bool _corrupt_next;
+};
+
+int main(int argc, char* argv[]) {
+  picoopt::parser opts;
+  opts.option('p', true);
+  opts.option('n', true);
+  opts.option('k', true);
+  opts.option('e', true);
+  opts.option('F', true);
+  opts.option('R', true);
+  opts.option('c', true);
+  opts.option('b', true);
+  opts.option('w', true);
+  opts.option('W', true);
+  opts.option('x', true);
+  opts.option('C', true);
+  opts.option('g', true);
+  opts.option('S', true);
+  opts.option('K', true);
+  opts.option('v');
+
+  if(!opts.parse(argc, argv) || opts.has('h') || !opts.valid() || opts.args().size() != 0) {
+    cout << "Usage: " << argv[0] << " [option] ..." << endl;
+    for(int i = 0; i < sizeof(usage) / sizeof(usage[0]); i++)
+        cout << usage[i] << endl;
+    return 1;
+  }
+
+  geometry g;
+  g.page_words = opts.has('p') ? strtoul(opts.get('p').c_str(), NULL, 0) : 32;
+  g.flash_pages = opts.has('n') ? strtoul(opts.get('n').c_str(), NULL, 0) : 128;
+  g.boot_pages = opts.has('k') ? strtoul(opts.get('k').c_str(), NULL, 0) : 16;
+  g.eeprom_bytes = opts.has('e') ? strtoul(opts.get('e').c_str(), NULL, 0) : 512;
+  g.features = opts.has('F') ? strtoul(opts.get('F').c_str(), NULL, 0) : 0x1ff;
+  g.ring_bytes = opts.has('R') ? strtoul(opts.get('R').c_str(), NULL, 0) : 256;
+  g.f_cpu = opts.has('c') ? strtoul(opts.get('c').c_str(), NULL, 0) : 16000000;
+  g.baud = opts.has('b') ? strtoul(opts.get('b').c_str(), NULL, 0) : 115200;
+  g.flash_us = opts.has('w') ? strtoul(opts.get('w').c_str(), NULL, 0) : 4000;
+  g.eeprom_us = opts.has('W') ? strtoul(opts.get('W').c_str(), NULL, 0) : 8500;
+  g.drop = strtoul(opts.get('x').c_str(), NULL, 0);
+  g.corrupt = strtoul(opts.get('C').c_str(), NULL, 0);
+  g.garble = strtoul(opts.get('g').c_str(), NULL, 0);
+  g.corrupt_packet = strtoul(opts.get('K').c_str(), NULL, 0);
+  g.verbose = opts.has('v');
+  srand(opts.has('S') ? strtoul(opts.get('S').c_str(), NULL, 0) : time(NULL));
+
+  // sizes are sent as powers of two, and page words in one byte
+  if(g.page_words == 0 || g.page_words > 255 || g.boot_pages > 255 ||
+        g.flash_pages != 1u << ln2(g.flash_pages) || g.boot_pages >= g.flash_pages ||
+        (g.eeprom_bytes != 0 && g.eeprom_bytes != 1u << ln2(g.eeprom_bytes)) ||
+        g.ring_bytes == 0 || g.ring_bytes != 1u << ln2(g.ring_bytes) || g.f_cpu == 0) {
+    cerr << "invalid geometry!" << endl;
+    return 1;
+  }
+
+  device d(g);
+  string name = d.open();
+  if(name == "") {
+    cerr << "cannot create pseudo-terminal!" << endl;
+    return 1;
+  }
+
+  cout << name << endl;
+  d.run();
+
+  return 0;
+}